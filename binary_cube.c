@@ -31,6 +31,18 @@
 #include <stdio.h>
 #include <string.h>
 #include <sys/time.h>
+#include <time.h>
+#include <pthread.h>
+#include <search.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __linux__
+  #include <linux/perf_event.h>
+  #include <sys/syscall.h>
+  #include <sys/ioctl.h>
+#endif
 
 #define BSC_M 8
 
@@ -38,1096 +50,7990 @@
 
 #define BSC_Z_MIN 8
 
+// Number of keys get_key_batch moves through the cube in lockstep.
+
+#define BSC_BATCH 16
+
+#ifdef __GNUC__
+  #define BSC_PREFETCH(addr) __builtin_prefetch(addr)
+#else
+  #define BSC_PREFETCH(addr)
+#endif
+
+// Key type of the cube, every floor and Z slot holds a bsc_key and is only compared through BSC_LT and BSC_EQ.
+
+#define BSC_KEY_INT    0
+#define BSC_KEY_LONG   1
+#define BSC_KEY_DOUBLE 2
+#define BSC_KEY_STR    3
+
+#ifndef BSC_KEY
+#define BSC_KEY BSC_KEY_INT
+#endif
+
+// A string key holds its first 8 bytes as a big endian integer next to a pointer to the string, so keys that differ
+// in their prefix are compared without leaving the node. The strings are owned by the caller, like the values.
+
+#if BSC_KEY == BSC_KEY_STR
+struct bsc_str
+{
+	unsigned long long prefix;
+	const char *str;
+};
+typedef struct bsc_str bsc_key;
+#define BSC_LT(a, b) ((a).prefix != (b).prefix ? (a).prefix < (b).prefix : ((a).prefix & 255) && strcmp((a).str + 8, (b).str + 8) < 0)
+#define BSC_EQ(a, b) ((a).prefix == (b).prefix && (((a).prefix & 255) == 0 || strcmp((a).str + 8, (b).str + 8) == 0))
+#define BSC_KEY_FMT "%s"
+#define BSC_KEY_ARG(key) (key).str
+#else
+#if BSC_KEY == BSC_KEY_LONG
+typedef long long bsc_key;
+#define BSC_KEY_FMT "%019lld"
+#elif BSC_KEY == BSC_KEY_DOUBLE
+typedef double bsc_key;
+#define BSC_KEY_FMT "%f"
+#else
+typedef int bsc_key;
+#define BSC_KEY_FMT "%010d"
+#endif
+#define BSC_LT(a, b) ((a) < (b))
+#define BSC_EQ(a, b) ((a) == (b))
+#define BSC_KEY_ARG(key) (key)
+#endif
+
+// Store values of this many bytes inline in the Z axes instead of a void pointer per slot, so a hit reads the key
+// and value from the same node. Values are passed in by address and copied, lookups return the address of the
+// value inside the cube, which stays valid until the cube is modified. 0 keeps the pointers.
+
+#ifndef BSC_VAL_SIZE
+#define BSC_VAL_SIZE 0
+#endif
+
+#if BSC_VAL_SIZE
+struct bsc_val
+{
+	long long data[(BSC_VAL_SIZE + 7) / 8];
+};
+typedef struct bsc_val bsc_val;
+#define BSC_GET_VAL(slot) ((void *) &(slot))
+#define BSC_SET_VAL(slot, val) ((val) ? memcpy(&(slot), (val), BSC_VAL_SIZE) : memset(&(slot), 0, BSC_VAL_SIZE))
+#else
+typedef void *bsc_val;
+#define BSC_GET_VAL(slot) (slot)
+#define BSC_SET_VAL(slot, val) ((slot) = (val))
+#endif
+
+// Use SIMD for the Z axis search and small Y axis searches, selected at run time. Only int keys are searched with SIMD.
+
+#ifndef BSC_SIMD
+#define BSC_SIMD 1
+#endif
+
+// Y axes up to this size are searched with SIMD, larger ones use the quaternary search.
+
+#define BSC_Y_SIMD 64
+
+#if BSC_SIMD && BSC_KEY == BSC_KEY_INT && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  #define BSC_X86 1
+  #include <immintrin.h>
+#else
+  #define BSC_X86 0
+#endif
+
+#if BSC_Z_MAX % 8 || BSC_M % 8
+  #error "BSC_Z_MAX and BSC_M must be multiples of 8 for the SIMD search."
+#endif
+
+#if BSC_Z_MAX > 64 || BSC_Y_SIMD > 64
+  #error "The SIMD search handles at most 64 keys."
+#endif
+
+// Keep Fenwick trees over w_volume and x_volume for logarithmic index searches.
+
+#ifndef BSC_RANK
+#define BSC_RANK 0
+#endif
+
+// Keep an insert buffer of this many keys per w_node, set_key appends to it and a full buffer is merged into the
+// x, y and z axes as one sorted batch. Calls that need sorted order flush every buffer first, and cube->volume
+// only counts flushed keys. 0 disables the buffers, 4096 suits cubes of a few million keys.
+
+#ifndef BSC_BUFFER
+#define BSC_BUFFER 0
+#endif
+
+// The unsorted tail of a buffer is sorted into the rest once it holds this many keys, so lookups scan at most this many.
+
+#define BSC_BUFFER_TAIL (BSC_BUFFER < 64 ? BSC_BUFFER : 64)
+
+#if BSC_BUFFER > 65535
+  #error "BSC_BUFFER must fit in an unsigned short."
+#endif
+
+// Use 64 bit volumes and 32 bit axis sizes so a single cube can grow past 2^31 keys, at the cost of a larger
+// layout. The compact layout overflows x_volume once m_size grows past roughly 2000.
+
+#ifndef BSC_LARGE
+#define BSC_LARGE 0
+#endif
+
+#if BSC_LARGE
+typedef long long bsc_vol;
+typedef unsigned int bsc_xvol;
+typedef unsigned int bsc_size;
+#else
+typedef int bsc_vol;
+typedef unsigned short bsc_xvol;
+typedef unsigned short bsc_size;
+#endif
+
+// Carve nodes and axis arrays from per cube slabs, set to 0 to use malloc.
+
+#ifndef BSC_POOL
+#define BSC_POOL 1
+#endif
+
+#define BSC_SLAB_SIZE (64 * 1024)
+
+#define BSC_SLAB_ALIGN 16
+
+// Blocks larger than BSC_SLAB_MAX are allocated with malloc and kept on a list.
+
+#define BSC_SLAB_MAX (BSC_SLAB_SIZE / 8)
+
+#define BSC_SLAB_CLASSES (BSC_SLAB_MAX / BSC_SLAB_ALIGN + 1)
+
+// Add get_key_mt, set_key_mt and del_key_mt for many readers and a few writers. Readers take no locks, they
+// validate a seqlock count on the cube and on the w_node they descend into and retry when either changed. A writer
+// holds the cube lock shared and the mutex of its w_node, changes that touch the w axis or another w_node take the
+// cube lock exclusively. Freed blocks stay mapped until destroy_cube, so a reader never faults on a stale pointer.
+
+#ifndef BSC_MT
+#define BSC_MT 0
+#endif
+
+#if BSC_MT && !BSC_POOL
+  #error "BSC_MT needs BSC_POOL to keep freed nodes readable."
+#endif
+
+#if BSC_MT && (BSC_RANK || BSC_BUFFER || BSC_VAL_SIZE)
+  #error "BSC_MT does not support BSC_RANK, BSC_BUFFER or BSC_VAL_SIZE."
+#endif
+
+#if BSC_MT && BSC_KEY == BSC_KEY_STR
+  #error "BSC_MT readers cannot follow string pointers from stale nodes."
+#endif
+
+#if BSC_MT
+  #define BSC_ADD(var, val) __atomic_add_fetch(&(var), (val), __ATOMIC_RELAXED)
+#else
+  #define BSC_ADD(var, val) ((var) += (val))
+#endif
+
+// Add cube_snapshot and release_snapshot for point in time views that stay valid while the cube changes. Nodes
+// carry the generation they were created in, a write copies an older node and the path above it first, and a
+// replaced node is retired until every snapshot that could still reach it is released.
+
+#ifndef BSC_MVCC
+#define BSC_MVCC 0
+#endif
+
+#if BSC_MVCC && (BSC_RANK || BSC_BUFFER || BSC_MT)
+  #error "BSC_MVCC does not support BSC_RANK, BSC_BUFFER or BSC_MT."
+#endif
+
+#if BSC_MVCC
+  #define BSC_RETIRE(cube, ptr, size, gen) retire_block(cube, ptr, size, gen)
+  #define BSC_OWN_W(cube, w) own_w_node(cube, w)
+  #define BSC_OWN_X(cube, w, x) own_x_node(cube, w, x)
+  #define BSC_OWN_Y(cube, w, x, y) own_y_node(cube, w, x, y)
+#else
+  #define BSC_RETIRE(cube, ptr, size, gen) bsc_free(cube, ptr, size)
+  #define BSC_OWN_W(cube, w) ((cube)->w_axis[w])
+  #define BSC_OWN_X(cube, w, x) ((cube)->w_axis[w]->x_axis[x])
+  #define BSC_OWN_Y(cube, w, x, y) ((cube)->w_axis[w]->x_axis[x]->y_axis[y])
+#endif
+
+// Keep a copy of the w floors and of every w_node's x floors in Eytzinger order, where the children of slot k are
+// at 2k and 2k + 1, so the first levels of a search share a few cache lines and the later ones are prefetched. A
+// change to the floors marks the copy stale and the call that changed them rebuilds it before returning, so this
+// suits cubes that are read far more often than their upper levels change. Lookups only read the copies.
+
+#ifndef BSC_EYTZ
+#define BSC_EYTZ 0
+#endif
+
+#if BSC_EYTZ && (BSC_MT || BSC_MVCC)
+  #error "BSC_EYTZ does not support BSC_MT or BSC_MVCC."
+#endif
+
+#if BSC_EYTZ
+  #define BSC_SEARCH_W(cube, key) search_w_eytz(cube, key)
+  #define BSC_SEARCH_X(cube, w, key) search_x_eytz(cube, w, key)
+  #define BSC_STALE_W(cube) ((cube)->w_eytz_size = 0, (cube)->eytz_stale = 1)
+  #define BSC_STALE_X(cube, w_node) ((w_node)->x_eytz_size = 0, (cube)->eytz_stale = 1)
+  #define BSC_REFRESH(cube) ((cube)->eytz_stale ? refresh_eytz(cube) : (void) 0)
+#else
+  #define BSC_SEARCH_W(cube, key) search_wx((cube)->w_floor, (cube)->w_size, key)
+  #define BSC_SEARCH_X(cube, w, key) search_wx((cube)->w_axis[w]->x_floor, (cube)->x_size[w], key)
+  #define BSC_STALE_W(cube)
+  #define BSC_STALE_X(cube, w_node)
+  #define BSC_REFRESH(cube)
+#endif
+
+// BSC_STATS counts splits, merges, bytes moved by inserts and removes, allocations, and the binary search steps
+// of lookups. The counters are read with cube_stats, which also reports the fill and size distribution of every
+// level without BSC_STATS.
+
+#ifndef BSC_STATS
+#define BSC_STATS 0
+#endif
+
+// The counters are added atomically, shard_get_key reads a cube from several threads.
+
+#if BSC_STATS
+  #define BSC_STAT(cube, field, val) __atomic_add_fetch(&(cube)->counts.field, (val), __ATOMIC_RELAXED)
+#else
+  #define BSC_STAT(cube, field, val)
+#endif
+
+struct bsc_counts
+{
+	unsigned long long w_splits;
+	unsigned long long x_splits;
+	unsigned long long y_splits;
+	unsigned long long w_merges;
+	unsigned long long x_merges;
+	unsigned long long y_merges;
+	unsigned long long moved;
+	unsigned long long allocs;
+	unsigned long long reallocs;
+	unsigned long long frees;
+	unsigned long long lookups;
+	unsigned long long lookup_depth;
+};
+
+struct bsc_slab
+{
+	struct bsc_slab *next;
+	struct bsc_slab *prev;
+	void *free;
+	char *bump;
+	unsigned int live;
+	unsigned int size;
+};
+
+struct bsc_large
+{
+	struct bsc_large *next;
+	struct bsc_large *prev;
+};
+
+struct bsc_pool
+{
+	struct bsc_slab *slabs[BSC_SLAB_CLASSES];
+	struct bsc_slab *full;
+	struct bsc_large *large;
+	size_t slab_cnt;
+#if BSC_MT
+	pthread_mutex_t lock;
+#endif
+};
+
 struct cube
 {
-	int *w_floor;
+	bsc_key *w_floor;
 	struct w_node **w_axis;
-	unsigned short *x_size;
-	int *w_volume;
-	int volume;
-	unsigned short w_size;
-	unsigned short m_size;
+	bsc_size *x_size;
+	bsc_vol *w_volume;
+	bsc_vol volume;
+	bsc_size w_size;
+	bsc_size m_size;
+	bsc_size w_max;
+	unsigned int stamp;
+	bsc_size trim_w;
+	bsc_size trim_x;
+#if BSC_BUFFER
+	int buffered;
+#endif
+#if BSC_VAL_SIZE
+	bsc_val removed;
+#endif
+#if BSC_RANK
+	bsc_vol *w_tree;
+	bsc_size w_tree_max;
+	unsigned char w_ranked;
+#endif
+#if BSC_EYTZ
+	bsc_key *w_eytz;
+	unsigned int w_eytz_max;
+	bsc_size w_eytz_size;
+	unsigned char eytz_stale;
+#endif
+#if BSC_POOL
+	struct bsc_pool pool;
+#endif
+#if BSC_MT
+	pthread_rwlock_t lock;
+	unsigned int seq;
+#endif
+	char *map;
+	size_t map_size;
+#if BSC_STATS
+	struct bsc_counts counts;
+#endif
+#if BSC_MVCC
+	unsigned int gen;
+	unsigned int w_gen;
+	int reclaim;
+	struct cube *origin;
+	struct cube *snaps;
+	struct cube *next_snap;
+	struct bsc_retired *retired;
+	size_t retired_size;
+	size_t retired_max;
+	pthread_mutex_t snap_lock;
+#endif
 };
 
 struct w_node
 {
-	int *x_floor;
+	bsc_key *x_floor;
 	struct x_node **x_axis;
-	unsigned short *y_size;
-	unsigned short *x_volume;
+	bsc_size *y_size;
+	bsc_xvol *x_volume;
+	bsc_size x_max;
+#if BSC_RANK
+	bsc_vol *x_tree;
+	bsc_size x_tree_max;
+	unsigned char x_ranked;
+#endif
+#if BSC_EYTZ
+	bsc_key *x_eytz;
+	unsigned int x_eytz_max;
+	bsc_size x_eytz_size;
+#endif
+#if BSC_BUFFER
+	bsc_key *buf_keys;
+	bsc_val *buf_vals;
+	unsigned short buf_size;
+	unsigned short buf_sort;
+#endif
+#if BSC_MT
+	pthread_mutex_t lock;
+	unsigned int seq;
+#endif
+#if BSC_MVCC
+	unsigned int gen;
+#endif
 };
 
 struct x_node
 {
-	int *y_floor;
+	bsc_key *y_floor;
 	struct y_node **y_axis;
 	unsigned char *z_size;
+	bsc_size y_max;
+#if BSC_MVCC
+	unsigned int gen;
+#endif
 };
 
 struct y_node
 {
-	int z_keys[BSC_Z_MAX];
-	void *z_vals[BSC_Z_MAX];
+	bsc_key z_keys[BSC_Z_MAX];
+	bsc_val z_vals[BSC_Z_MAX];
+#if BSC_MVCC
+	unsigned int gen;
+#endif
+};
+
+#if BSC_MVCC
+struct bsc_retired
+{
+	void *ptr;
+	size_t size;
+	unsigned int gen;
+};
+#endif
+
+// A cursor is current while the cube's stamp is unchanged, otherwise it checks its key and falls back to find_key.
+
+struct cursor
+{
+	struct cube *cube;
+	struct y_node *y_node;
+	unsigned int stamp;
+	bsc_key key;
+	bsc_size w;
+	bsc_size x;
+	bsc_size y;
+	bsc_size z;
+	unsigned char z_size;
+	unsigned char valid;
 };
 
-inline void *find_key(struct cube *cube, int key, unsigned short *w, unsigned short *x, unsigned short *y, unsigned short *z);
+// A hint is held by the caller and remembers the Z axis of the last key, it stays safe to use after the cube changes.
 
-void split_w_node(struct cube *cube, unsigned short w);
-void merge_w_node(struct cube *cube, unsigned short w1, unsigned short w2);
+struct hint
+{
+	bsc_size w;
+	bsc_size x;
+	bsc_size y;
+};
 
-void split_x_node(struct cube *cube, unsigned short w, unsigned short x);
-void merge_x_node(struct cube *cube, unsigned short w, unsigned short x1, unsigned short x2);
+void *find_key(struct cube *cube, bsc_key key, bsc_size *w, bsc_size *x, bsc_size *y, bsc_size *z);
 
-void split_y_node(struct cube *cube, unsigned short w, unsigned short x, unsigned short y);
-void merge_y_node(struct cube *cube, unsigned short w, unsigned short x, unsigned short y1, unsigned short y2);
+void insert_w_node(struct cube *cube, bsc_size w);
+void split_w_node(struct cube *cube, bsc_size w);
+void merge_w_node(struct cube *cube, bsc_size w1, bsc_size w2);
 
-void insert_z_node(struct cube *cube, unsigned short w, unsigned short x, unsigned short y, unsigned short z, int key, void *val);
-void *remove_z_node(struct cube *cube, unsigned short w, unsigned short x, unsigned short y, unsigned short z);
+void insert_x_node(struct cube *cube, bsc_size w, bsc_size x);
+void split_x_node(struct cube *cube, bsc_size w, bsc_size x);
+void merge_x_node(struct cube *cube, bsc_size w, bsc_size x1, bsc_size x2);
 
-void *find_index(struct cube *cube, int index, unsigned short *w_index, unsigned short *x_index, unsigned short *y_index, unsigned short *z_index);
+void insert_y_node(struct cube *cube, bsc_size w, bsc_size x, bsc_size y);
+void split_y_node(struct cube *cube, bsc_size w, bsc_size x, bsc_size y);
+void merge_y_node(struct cube *cube, bsc_size w, bsc_size x, bsc_size y1, bsc_size y2);
 
-struct cube *create_cube(void)
+void insert_z_node(struct cube *cube, bsc_size w, bsc_size x, bsc_size y, bsc_size z, bsc_key key, void *val);
+void split_full_node(struct cube *cube, bsc_size w, bsc_size x, bsc_size y);
+void *remove_z_node(struct cube *cube, bsc_size w, bsc_size x, bsc_size y, bsc_size z);
+void *pop_z_node(struct cube *cube, bsc_size w, bsc_size x, bsc_size y, bsc_size z);
+
+void *find_index(struct cube *cube, bsc_vol index, bsc_size *w_index, bsc_size *x_index, bsc_size *y_index, bsc_size *z_index);
+
+void buffer_key(struct cube *cube, bsc_size w, bsc_key key, void *val);
+void flush_buffer(struct cube *cube, bsc_size w);
+void flush_cube(struct cube *cube);
+
+void refresh_eytz(struct cube *cube);
+
+// 0 = quaternary, 1 = sse4.1, 2 = avx2
+
+int bsc_simd_level = -1;
+
+void init_simd(void)
 {
-	struct cube *cube;
+	bsc_simd_level = 0;
 
-	cube = (struct cube *) calloc(1, sizeof(struct cube));
+#if BSC_X86
+	__builtin_cpu_init();
 
-	return cube;
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt"))
+	{
+		bsc_simd_level = 2;
+	}
+	else if (__builtin_cpu_supports("sse4.1") && __builtin_cpu_supports("popcnt"))
+	{
+		bsc_simd_level = 1;
+	}
+#endif
 }
 
-void destroy_cube(struct cube *cube)
+#if BSC_KEY == BSC_KEY_STR
+
+// Makes a string key, the string must stay valid while the key is in the cube.
+
+bsc_key str_key(const char *str)
 {
-	if (cube->w_size)
+	bsc_key key;
+	int cnt;
+
+	key.prefix = 0;
+	key.str = str;
+
+	for (cnt = 0 ; cnt < 8 && str[cnt] ; cnt++)
 	{
-		struct w_node *w_node;
-		struct x_node *x_node;
-		struct y_node *y_node;
+		key.prefix |= (unsigned long long) (unsigned char) str[cnt] << (56 - cnt * 8);
+	}
+	return key;
+}
+#endif
 
-		register unsigned short w, x, y;
+// Returns the index of the last key <= key, keys[0] <= key is assumed.
 
-		for (w = 0 ; w < cube->w_size ; w++)
-		{
-			w_node = cube->w_axis[w];
+bsc_size search_wx(const bsc_key *keys, bsc_size size, bsc_key key)
+{
+	bsc_size mid, i;
 
-			for (x = 0 ; x < cube->x_size[w] ; x++)
-			{
-				x_node = w_node->x_axis[x];
+	mid = i = size - 1;
 
-				for (y = 0 ; y < w_node->y_size[x] ; y++)
-				{
-					y_node = x_node->y_axis[y];
+	while (mid > 3)
+	{
+		mid /= 2;
+
+		if (BSC_LT(key, keys[i - mid])) i -= mid;
+	}
+	while (BSC_LT(key, keys[i])) --i;
+
+	return i;
+}
 
-					free(y_node);
+bsc_size search_quad(const bsc_key *keys, bsc_size size, bsc_key key)
+{
+	bsc_size mid, i;
+
+	mid = i = size - 1;
+
+	while (mid > 7)
+	{
+		mid /= 4;
+
+		if (BSC_LT(key, keys[i - mid]))
+		{
+			i -= mid;
+			if (BSC_LT(key, keys[i - mid]))
+			{
+				i -= mid;
+				if (BSC_LT(key, keys[i - mid]))
+				{
+					i -= mid;
 				}
-				free(x_node);
 			}
-			free(w_node);
 		}
-		free(cube->w_floor);
-		free(cube->w_axis);
-		free(cube->w_volume);
-		free(cube->x_size);
 	}
-	free(cube);
+	while (BSC_LT(key, keys[i])) --i;
+
+	return i;
 }
 
-void *get_index(struct cube *cube, int index)
-{
-	unsigned short w, x, y, z;
+#if BSC_X86
 
-	return find_index(cube, index, &w, &x, &y, &z);
-}
+// Branchless compare and popcount, the array must be readable up to size rounded up to 8.
 
-void *del_index(struct cube *cube, int index)
+__attribute__((target("avx2,popcnt"))) bsc_size search_avx2(const int *keys, bsc_size size, int key)
 {
-	unsigned short w, x, y, z;
+	__m256i k = _mm256_set1_epi32(key);
+	unsigned long long gt = 0;
+	bsc_size i;
 
-	if (find_index(cube, index, &w, &x, &y, &z))
+	for (i = 0 ; i < size ; i += 8)
 	{
-		return remove_z_node(cube, w, x, y, z);
+		__m256i v = _mm256_loadu_si256((const __m256i *) (keys + i));
+
+		gt |= (unsigned long long) _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(v, k))) << i;
 	}
-	return NULL;
+	gt &= ~0ULL >> (64 - size);
+
+	return size - __builtin_popcountll(gt) - 1;
 }
 
-void set_index(struct cube *cube, int index, void *val)
+__attribute__((target("sse4.1,popcnt"))) bsc_size search_sse4(const int *keys, bsc_size size, int key)
 {
-	unsigned short w, x, y, z;
+	__m128i k = _mm_set1_epi32(key);
+	unsigned long long gt = 0;
+	bsc_size i;
 
-	if (find_index(cube, index, &w, &x, &y, &z))
+	for (i = 0 ; i < size ; i += 8)
 	{
-		cube->w_axis[w]->x_axis[x]->y_axis[y]->z_vals[z] = val;
+		__m128i v1 = _mm_loadu_si128((const __m128i *) (keys + i));
+		__m128i v2 = _mm_loadu_si128((const __m128i *) (keys + i + 4));
+
+		gt |= (unsigned long long) _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(v1, k))) << i;
+		gt |= (unsigned long long) _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(v2, k))) << (i + 4);
 	}
+	gt &= ~0ULL >> (64 - size);
+
+	return size - __builtin_popcountll(gt) - 1;
 }
+#endif
 
-void *get_key(struct cube *cube, int key)
+bsc_size search_z(const bsc_key *keys, bsc_size size, bsc_key key)
 {
-	unsigned short w, x, y, z;
-
-	return find_key(cube, key, &w, &x, &y, &z);
+#if BSC_X86
+	if (bsc_simd_level == 2)
+	{
+		return search_avx2(keys, size, key);
+	}
+	if (bsc_simd_level == 1)
+	{
+		return search_sse4(keys, size, key);
+	}
+#endif
+	return search_quad(keys, size, key);
 }
 
-void *del_key(struct cube *cube, int key)
-{
-	unsigned short w, x, y, z;
+// y_floor is allocated in multiples of BSC_M so small Y axes can be read in blocks of 8.
 
-	if (find_key(cube, key, &w, &x, &y, &z))
+bsc_size search_y(const bsc_key *keys, bsc_size size, bsc_key key)
+{
+#if BSC_X86
+	if (size <= BSC_Y_SIMD)
 	{
-		return remove_z_node(cube, w, x, y, z);
+		return search_z(keys, size, key);
 	}
-	return NULL;
+#endif
+	return search_quad(keys, size, key);
 }
 
-void set_key(struct cube *cube, int key, void *val)
+// Exponential search outward from pos, returns the index of the last key <= key, keys[0] <= key is assumed.
+
+bsc_size search_gallop(const bsc_key *keys, bsc_size size, bsc_size pos, bsc_key key)
 {
-	struct w_node *w_node;
-	struct x_node *x_node;
-	struct y_node *y_node;
+	int lo, hi, step = 1;
 
-	unsigned short mid, w, x, y, z;
+	lo = pos < size ? pos : size - 1;
 
-	if (cube->w_size == 0)
+	if (!BSC_LT(key, keys[lo]))
 	{
-		cube->m_size = BSC_M;
-
-		cube->w_floor = (int *) malloc(BSC_M * sizeof(int));
-		cube->w_axis = (struct w_node **) malloc(BSC_M * sizeof(struct w_node *));
-		cube->w_volume = (int *) malloc(BSC_M * sizeof(int));
-		cube->x_size = (unsigned short *) malloc(BSC_M * sizeof(unsigned short));
+		for (hi = lo + 1 ; hi < size && !BSC_LT(key, keys[hi]) ; step *= 2)
+		{
+			lo = hi;
+			hi = lo + step;
+		}
+		if (hi > size)
+		{
+			hi = size;
+		}
+	}
+	else
+	{
+		for (hi = lo ; BSC_LT(key, keys[lo]) ; step *= 2)
+		{
+			hi = lo;
+			lo = lo > step ? lo - step : 0;
+		}
+	}
+	return lo + search_wx(&keys[lo], hi - lo, key);
+}
 
-		w_node = cube->w_axis[0] = (struct w_node *) malloc(sizeof(struct w_node));
+#if BSC_POOL
 
-		w_node->x_floor = (int *) malloc(BSC_M * sizeof(int));
-		w_node->x_axis = (struct x_node **) malloc(BSC_M * sizeof(struct x_node *));
-		w_node->y_size = (unsigned short *) malloc(BSC_M * sizeof(unsigned short));
-		w_node->x_volume = (unsigned short *) malloc(BSC_M * sizeof(unsigned short));
+// Every slab is aligned to its size so a block finds its slab by masking the address.
 
-		x_node = w_node->x_axis[0] = (struct x_node *) malloc(sizeof(struct x_node));
+#define BSC_SLAB_HEAD ((sizeof(struct bsc_slab) + 63) / 64 * 64)
 
-		x_node->y_floor = (int *) malloc(BSC_M * sizeof(int));
-		x_node->y_axis = (struct y_node **) malloc(BSC_M * sizeof(struct y_node *));
-		x_node->z_size = (unsigned char *) malloc(BSC_M * sizeof(unsigned char));
+#define BSC_SLAB_ROUND(size) (((size) + BSC_SLAB_ALIGN - 1) / BSC_SLAB_ALIGN * BSC_SLAB_ALIGN)
 
-		y_node = x_node->y_axis[0] = (struct y_node *) malloc(sizeof(struct y_node));
+// Large blocks start a cache line after their header.
 
-		x_node->z_size[0] = 0;
+#define BSC_LARGE_HEAD ((sizeof(struct bsc_large) + 63) / 64 * 64)
 
-		cube->w_size = cube->x_size[0] = w_node->y_size[0] = 1;
-		cube->volume = cube->w_volume[0] = w_node->x_volume[0] = 0;
+struct bsc_slab *create_slab(struct bsc_pool *pool, unsigned int size)
+{
+	struct bsc_slab *slab;
 
-		w = x = y = z = 0;
+	if (posix_memalign((void **) &slab, BSC_SLAB_SIZE, BSC_SLAB_SIZE))
+	{
+		return NULL;
+	}
 
-		cube->w_floor[0] = w_node->x_floor[0] = x_node->y_floor[0] = key;
+	slab->free = NULL;
+	slab->bump = (char *) slab + BSC_SLAB_HEAD;
+	slab->live = 0;
+	slab->size = size;
 
-		goto insert;
-	}
+	pool->slab_cnt++;
 
-	if (key < cube->w_floor[0])
-	{
-		w_node = cube->w_axis[0];
-		x_node = w_node->x_axis[0];
-		y_node = x_node->y_axis[0];
+	return slab;
+}
 
-		w = x = y = z = 0;
+// A size class only lists slabs with room left, full slabs wait on the pool's full list until a block is freed.
 
-		cube->w_floor[0] = w_node->x_floor[0] = x_node->y_floor[0] = key;
+#define BSC_SLAB_FULL(slab) ((slab)->free == NULL && (slab)->bump + (slab)->size > (char *) (slab) + BSC_SLAB_SIZE)
 
-		goto insert;
+void unlink_slab(struct bsc_slab **head, struct bsc_slab *slab)
+{
+	if (slab->prev)
+	{
+		slab->prev->next = slab->next;
+	}
+	else
+	{
+		*head = slab->next;
 	}
 
-	// w
+	if (slab->next)
+	{
+		slab->next->prev = slab->prev;
+	}
+}
 
-	mid = w = cube->w_size - 1;
+void link_slab(struct bsc_slab **head, struct bsc_slab *slab)
+{
+	slab->prev = NULL;
+	slab->next = *head;
 
-	while (mid > 3)
+	if (*head)
 	{
-		mid /= 2;
-
-		if (key < cube->w_floor[w - mid]) w -= mid;
+		(*head)->prev = slab;
 	}
-	while (key < cube->w_floor[w]) --w;
+	*head = slab;
+}
 
-	w_node = cube->w_axis[w];
+// The head slab of a size class is the one allocated from, slabs that receive a free move to the head and a slab
+// that fills up moves to the full list, so a new slab is only created once every slab of the class is full.
 
-	// x
+void *pool_alloc(struct bsc_pool *pool, size_t size)
+{
+	struct bsc_slab *slab;
+	void *block;
 
-	mid = x = cube->x_size[w] - 1;
+	size = BSC_SLAB_ROUND(size);
 
-	while (mid > 3)
+	if (size > BSC_SLAB_MAX)
 	{
-		mid /= 2;
+		struct bsc_large *large;
 
-		if (key < w_node->x_floor[x - mid]) x -= mid;
-	}
-	while (key < w_node->x_floor[x]) --x;
+		if (posix_memalign((void **) &large, 64, BSC_LARGE_HEAD + size))
+		{
+			return NULL;
+		}
+		large->prev = NULL;
+		large->next = pool->large;
 
-	x_node = w_node->x_axis[x];
+		if (pool->large)
+		{
+			pool->large->prev = large;
+		}
+		pool->large = large;
 
-	// y
+		return (char *) large + BSC_LARGE_HEAD;
+	}
 
-	mid = y = w_node->y_size[x] - 1;
+	slab = pool->slabs[size / BSC_SLAB_ALIGN];
 
-	while (mid > 7)
+	if (slab == NULL)
 	{
-		mid /= 4;
+		slab = create_slab(pool, size);
 
-		if (key < x_node->y_floor[y - mid])
+		if (slab == NULL)
 		{
-			y -= mid;
-			if (key < x_node->y_floor[y - mid])
-			{
-				y -= mid;
-				if (key < x_node->y_floor[y - mid])
-				{
-					y -= mid;
-				}
-			}
+			return NULL;
 		}
+		link_slab(&pool->slabs[size / BSC_SLAB_ALIGN], slab);
 	}
-	while (key < x_node->y_floor[y]) --y;
 
-	y_node = x_node->y_axis[y];
+	if (slab->free)
+	{
+		block = slab->free;
+		slab->free = *(void **) block;
+	}
+	else
+	{
+		block = slab->bump;
+		slab->bump += size;
+	}
+	slab->live++;
 
-	// z
+	if (BSC_SLAB_FULL(slab))
+	{
+		unlink_slab(&pool->slabs[size / BSC_SLAB_ALIGN], slab);
+		link_slab(&pool->full, slab);
+	}
+	return block;
+}
 
-	mid = z = x_node->z_size[y] - 1;
+void pool_free(struct bsc_pool *pool, void *block, size_t size)
+{
+	struct bsc_slab *slab, **head;
 
-	while (mid > 7)
+	if (BSC_SLAB_ROUND(size) > BSC_SLAB_MAX)
 	{
-		mid /= 4;
+		struct bsc_large *large = (struct bsc_large *) ((char *) block - BSC_LARGE_HEAD);
 
-		if (key < y_node->z_keys[z - mid])
+		if (BSC_MT)
 		{
-			z -= mid;
-			if (key < y_node->z_keys[z - mid])
-			{
-				z -= mid;
-				if (key < y_node->z_keys[z - mid])
-				{
-					z -= mid;
-				}
-			}
+			return;
 		}
-	}
-	while (key < y_node->z_keys[z]) --z;
 
-	if (key == y_node->z_keys[z])
-	{
-		y_node->z_vals[z] = val;
+		if (large->prev)
+		{
+			large->prev->next = large->next;
+		}
+		else
+		{
+			pool->large = large->next;
+		}
+
+		if (large->next)
+		{
+			large->next->prev = large->prev;
+		}
+		free(large);
 
 		return;
 	}
 
-	++z;
+	slab = (struct bsc_slab *) ((size_t) block & ~((size_t) BSC_SLAB_SIZE - 1));
 
-	insert:
+	head = BSC_SLAB_FULL(slab) ? &pool->full : &pool->slabs[slab->size / BSC_SLAB_ALIGN];
 
-	++cube->volume;
-	++cube->w_volume[w];
-	++w_node->x_volume[x];
+	*(void **) block = slab->free;
+	slab->free = block;
 
-	++x_node->z_size[y];
+	if (--slab->live == 0 && !BSC_MT && (slab->prev || slab->next))
+	{
+		unlink_slab(head, slab);
 
-	if (z + 1 != x_node->z_size[y])
+		free(slab);
+
+		pool->slab_cnt--;
+
+		return;
+	}
+
+	if (slab->prev || head == &pool->full)
 	{
-		memmove(&y_node->z_keys[z + 1], &y_node->z_keys[z], (x_node->z_size[y] - z - 1) * sizeof(int));
-		memmove(&y_node->z_vals[z + 1], &y_node->z_vals[z], (x_node->z_size[y] - z - 1) * sizeof(void *));
+		unlink_slab(head, slab);
+		link_slab(&pool->slabs[slab->size / BSC_SLAB_ALIGN], slab);
 	}
+}
 
-	y_node->z_keys[z] = key;
-	y_node->z_vals[z] = val;
+void destroy_pool(struct bsc_pool *pool)
+{
+	struct bsc_slab *slab;
+	struct bsc_large *large;
+	unsigned int cnt;
 
-	if (x_node->z_size[y] == BSC_Z_MAX)
+	for (cnt = 0 ; cnt < BSC_SLAB_CLASSES ; cnt++)
 	{
-		split_y_node(cube, w, x, y);
-
-		if (cube->w_axis[w]->y_size[x] == cube->m_size)
+		while ((slab = pool->slabs[cnt]) != NULL)
 		{
-			split_x_node(cube, w, x);
+			pool->slabs[cnt] = slab->next;
 
-			if (cube->x_size[w] == cube->m_size)
-			{
-				split_w_node(cube, w);
-			}
+			free(slab);
 		}
 	}
-}
 
-inline void *find_key(struct cube *cube, int key, unsigned short *w_index, unsigned short *x_index, unsigned short *y_index, unsigned short *z_index)
-{
-	struct w_node *w_node;
-	struct x_node *x_node;
-	struct y_node *y_node;
+	while ((slab = pool->full) != NULL)
+	{
+		pool->full = slab->next;
 
-	unsigned short mid, w, x, y, z;
+		free(slab);
+	}
 
-	if (cube->w_size == 0 || key < cube->w_floor[0])
+	while ((large = pool->large) != NULL)
 	{
-		*w_index = *x_index = *y_index = *z_index = 0;
+		pool->large = large->next;
 
-		return NULL;
+		free(large);
 	}
+	pool->slab_cnt = 0;
+}
 
-	// w
+// pool_free keeps the last slab of a size class when it empties, this releases those too.
 
-	mid = w = cube->w_size - 1;
+void trim_pool(struct bsc_pool *pool)
+{
+	struct bsc_slab *slab;
+	unsigned int cnt;
 
-	while (mid > 3)
+	if (BSC_MT)
 	{
-		mid /= 2;
-
-		if (key < cube->w_floor[w - mid]) w -= mid;
+		return;
 	}
-	while (key < cube->w_floor[w]) --w;
 
-	w_node = cube->w_axis[w];
+	for (cnt = 0 ; cnt < BSC_SLAB_CLASSES ; cnt++)
+	{
+		slab = pool->slabs[cnt];
 
-	// x
+		if (slab && slab->live == 0 && slab->next == NULL)
+		{
+			pool->slabs[cnt] = NULL;
 
-	mid = x = cube->x_size[w] - 1;
+			free(slab);
 
-	while (mid > 3)
-	{
-		mid /= 2;
-
-		if (key < w_node->x_floor[x - mid]) x -= mid;
+			pool->slab_cnt--;
+		}
 	}
-	while (key < w_node->x_floor[x]) --x;
+}
+#endif
 
-	x_node = w_node->x_axis[x];
+#if BSC_POOL
 
-	// y
+// The pool calls of a cube, under BSC_MT they hold the pool lock. bsc_alloc, bsc_free and bsc_realloc count them.
 
-	mid = y = w_node->y_size[x] - 1;
+void *cube_pool_alloc(struct cube *cube, size_t size)
+{
+#if BSC_MT
+	void *block;
 
-	while (mid > 7)
-	{
-		mid /= 4;
+	pthread_mutex_lock(&cube->pool.lock);
 
-		if (key < x_node->y_floor[y - mid])
-		{
-			y -= mid;
-			if (key < x_node->y_floor[y - mid])
-			{
-				y -= mid;
-				if (key < x_node->y_floor[y - mid])
-				{
-					y -= mid;
-				}
-			}
-		}
+	block = pool_alloc(&cube->pool, size);
+
+	pthread_mutex_unlock(&cube->pool.lock);
+
+	return block;
+#else
+	return pool_alloc(&cube->pool, size);
+#endif
+}
+
+void cube_pool_free(struct cube *cube, void *ptr, size_t size)
+{
+#if BSC_MT
+	pthread_mutex_lock(&cube->pool.lock);
+
+	pool_free(&cube->pool, ptr, size);
+
+	pthread_mutex_unlock(&cube->pool.lock);
+#else
+	pool_free(&cube->pool, ptr, size);
+#endif
+}
+#endif
+
+void *bsc_alloc(struct cube *cube, size_t size)
+{
+	BSC_STAT(cube, allocs, 1);
+
+#if BSC_POOL
+	return cube_pool_alloc(cube, size);
+#else
+	return malloc(size);
+#endif
+}
+
+// Node axes are whole cache lines, which the pool hands out 64 byte aligned.
+
+void *bsc_alloc_line(struct cube *cube, size_t size)
+{
+#if BSC_POOL
+	return bsc_alloc(cube, size);
+#else
+	void *block;
+
+	BSC_STAT(cube, allocs, 1);
+
+	return posix_memalign(&block, 64, size) ? NULL : block;
+#endif
+}
+
+// Blocks inside a snapshot mapping are released with the mapping by destroy_cube.
+
+#define BSC_MAPPED(cube, ptr) ((char *) (ptr) >= (cube)->map && (char *) (ptr) < (cube)->map + (cube)->map_size)
+
+void bsc_free(struct cube *cube, void *ptr, size_t size)
+{
+	if (BSC_MAPPED(cube, ptr))
+	{
+		return;
 	}
-	while (key < x_node->y_floor[y]) --y;
+	BSC_STAT(cube, frees, 1);
 
-	y_node = x_node->y_axis[y];
+#if BSC_POOL
+	cube_pool_free(cube, ptr, size);
+#else
+	free(ptr);
+#endif
+}
 
-	// z
+void *bsc_realloc(struct cube *cube, void *ptr, size_t old_size, size_t new_size)
+{
+#if BSC_POOL
+	void *block;
 
-	mid = z = x_node->z_size[y] - 1;
+	BSC_STAT(cube, reallocs, 1);
 
-	while (mid > 7)
+	if (ptr == NULL)
 	{
-		mid /= 4;
+		return cube_pool_alloc(cube, new_size);
+	}
 
-		if (key < y_node->z_keys[z - mid])
-		{
-			z -= mid;
-			if (key < y_node->z_keys[z - mid])
-			{
-				z -= mid;
-				if (key < y_node->z_keys[z - mid])
-				{
-					z -= mid;
-				}
-			}
-		}
+	if (BSC_SLAB_ROUND(old_size) == BSC_SLAB_ROUND(new_size))
+	{
+		return ptr;
 	}
-	while (key < y_node->z_keys[z]) --z;
+	block = cube_pool_alloc(cube, new_size);
 
-	*w_index = w;
-	*x_index = x;
-	*y_index = y;
+	memcpy(block, ptr, old_size < new_size ? old_size : new_size);
 
-	if (key == y_node->z_keys[z])
+	if (!BSC_MAPPED(cube, ptr))
 	{
-		*z_index = z;
-
-		return y_node->z_vals[z];
+		cube_pool_free(cube, ptr, old_size);
 	}
+	return block;
+#else
+	if (BSC_MAPPED(cube, ptr))
+	{
+		void *block = malloc(new_size);
 
-	*z_index = z + 1;
+		memcpy(block, ptr, old_size < new_size ? old_size : new_size);
 
-	return NULL;
+		return block;
+	}
+	BSC_STAT(cube, reallocs, 1);
+
+	return realloc(ptr, new_size);
+#endif
 }
 
-inline void *find_index(struct cube *cube, int index, unsigned short *w_index, unsigned short *x_index, unsigned short *y_index, unsigned short *z_index)
+#if BSC_MVCC
+
+// A block of the current generation is unreachable from any snapshot, and without a snapshot nothing is shared.
+
+int node_shared(struct cube *cube, unsigned int gen)
 {
-	struct w_node *w_node;
-	struct x_node *x_node;
-	struct y_node *y_node;
-	register unsigned short w, x, y;
-	int total;
+	return gen != cube->gen && __atomic_load_n(&cube->snaps, __ATOMIC_ACQUIRE) != NULL;
+}
 
-	if (index < 0 || index >= cube->volume)
+// Shared blocks wait on the retired list for reclaim_blocks.
+
+void retire_block(struct cube *cube, void *ptr, size_t size, unsigned int gen)
+{
+	if (!node_shared(cube, gen))
 	{
-		return NULL;
+		bsc_free(cube, ptr, size);
+
+		return;
 	}
 
-	if (index < cube->volume / 2)
+	if (cube->retired_size == cube->retired_max)
 	{
-		total = 0;
+		cube->retired_max = cube->retired_max ? cube->retired_max * 2 : 64;
 
-		for (w = 0 ; w < cube->w_size ; w++)
-		{
-			w_node = cube->w_axis[w];
+		cube->retired = (struct bsc_retired *) realloc(cube->retired, cube->retired_max * sizeof(struct bsc_retired));
+	}
+	cube->retired[cube->retired_size].ptr = ptr;
+	cube->retired[cube->retired_size].size = size;
+	cube->retired[cube->retired_size].gen = cube->gen;
 
-			if (total + cube->w_volume[w] > index)
-			{
-				if (index > total + cube->w_volume[w] / 2)
-				{
-					total += cube->w_volume[w];
+	cube->retired_size++;
+}
+#endif
 
-					goto backward_x;
-				}
-				forward_x:
+// Axis arrays are allocated per node with room for size entries.
 
-				for (x = 0 ; x < cube->x_size[w] ; x++)
-				{
-					x_node = w_node->x_axis[x];
+void resize_cube(struct cube *cube, bsc_size size)
+{
+	bsc_size max = cube->w_max;
 
-					if (total + w_node->x_volume[x] > index)
-					{
-						if (index > total + w_node->x_volume[x] / 2)
-						{
-							total += w_node->x_volume[x];
+	cube->w_floor = (bsc_key *) bsc_realloc(cube, cube->w_floor, max * sizeof(bsc_key), size * sizeof(bsc_key));
+	cube->w_axis = (struct w_node **) bsc_realloc(cube, cube->w_axis, max * sizeof(struct w_node *), size * sizeof(struct w_node *));
+	cube->w_volume = (bsc_vol *) bsc_realloc(cube, cube->w_volume, max * sizeof(bsc_vol), size * sizeof(bsc_vol));
+	cube->x_size = (bsc_size *) bsc_realloc(cube, cube->x_size, max * sizeof(bsc_size), size * sizeof(bsc_size));
 
-							goto backward_y;
-						}
-						forward_y:
+	cube->w_max = size;
+}
 
-						for (y = 0 ; y < w_node->y_size[x] ; y++)
-						{
-							y_node = x_node->y_axis[y];
+void free_cube_axis(struct cube *cube)
+{
+	bsc_size max = cube->w_max;
 
-							if (total + x_node->z_size[y] > index)
-							{
-								*w_index = w;
-								*x_index = x;
-								*y_index = y;
-								*z_index = index - total;
+	BSC_RETIRE(cube, cube->w_floor, max * sizeof(bsc_key), cube->w_gen);
+	BSC_RETIRE(cube, cube->w_axis, max * sizeof(struct w_node *), cube->w_gen);
+	BSC_RETIRE(cube, cube->w_volume, max * sizeof(bsc_vol), cube->w_gen);
+	BSC_RETIRE(cube, cube->x_size, max * sizeof(bsc_size), cube->w_gen);
 
-								return y_node->z_vals[index - total];
-							}
-							total += x_node->z_size[y];
-						}
-					}
-					total += w_node->x_volume[x];
-				}
-			}
-			total += cube->w_volume[w];
-		}
-	}
-	else
+	cube->w_floor = NULL;
+	cube->w_axis = NULL;
+	cube->w_volume = NULL;
+	cube->x_size = NULL;
+
+	cube->w_max = 0;
+
+#if BSC_MVCC
+	cube->w_gen = cube->gen;
+#endif
+#if BSC_RANK
+	if (cube->w_tree)
 	{
-		total = cube->volume;
+		bsc_free(cube, cube->w_tree, cube->w_tree_max * sizeof(bsc_vol));
 
-		for (w = cube->w_size - 1 ; w >= 0 ; w--)
-		{
-			w_node = cube->w_axis[w];
+		cube->w_tree = NULL;
+		cube->w_tree_max = 0;
+	}
+	cube->w_ranked = 0;
+#endif
+#if BSC_EYTZ
+	if (cube->w_eytz)
+	{
+		bsc_free(cube, cube->w_eytz, cube->w_eytz_max * sizeof(bsc_key));
 
-			if (total - cube->w_volume[w] <= index)
-			{
-				if (index < total - cube->w_volume[w] / 2)
-				{
-					total -= cube->w_volume[w];
+		cube->w_eytz = NULL;
+		cube->w_eytz_max = 0;
+	}
+	cube->w_eytz_size = 0;
+#endif
+}
 
-					goto forward_x;
-				}
-				backward_x:
+// The axes of a w_node or x_node share one block, the floor keys first so the search reads whole cache lines
+// of keys, then the child pointers and the sizes. x_floor and y_floor point at the start of the block.
 
-				for (x = cube->x_size[w] - 1 ; x >= 0 ; x--)
-				{
-					x_node = w_node->x_axis[x];
+#define BSC_PTR_ROUND(size) (((size) + sizeof(void *) - 1) / sizeof(void *) * sizeof(void *))
 
-					if (total - w_node->x_volume[x] <= index)
-					{
-						if (index < total - w_node->x_volume[x] / 2)
-						{
-							total -= w_node->x_volume[x];
+#define BSC_LINE_ROUND(size) (((size) + 63) / 64 * 64)
 
-							goto forward_y;
-						}
-						backward_y:
+size_t w_axis_size(bsc_size size)
+{
+	return BSC_LINE_ROUND(BSC_PTR_ROUND(size * sizeof(bsc_key)) + size * (sizeof(struct x_node *) + sizeof(bsc_xvol) + sizeof(bsc_size)));
+}
 
-						for (y = w_node->y_size[x] - 1 ; y >= 0 ; y--)
-						{
-							y_node = x_node->y_axis[y];
+size_t x_axis_size(bsc_size size)
+{
+	return BSC_LINE_ROUND(BSC_PTR_ROUND(size * sizeof(bsc_key)) + size * (sizeof(struct y_node *) + sizeof(unsigned char)));
+}
 
-							if (total - x_node->z_size[y] <= index)
-							{
-								*w_index = w;
-								*x_index = x;
-								*y_index = y;
-								*z_index = x_node->z_size[y] - (total - index);
+void place_w_axis(struct w_node *w_node, char *block, bsc_size size)
+{
+	w_node->x_floor = (bsc_key *) block;
+	w_node->x_axis = (struct x_node **) (block + BSC_PTR_ROUND(size * sizeof(bsc_key)));
+	w_node->x_volume = (bsc_xvol *) &w_node->x_axis[size];
+	w_node->y_size = (bsc_size *) &w_node->x_volume[size];
 
-								return y_node->z_vals[x_node->z_size[y] - (total - index)];
-							}
-							total -= x_node->z_size[y];
-						}
-					}
-					total -= w_node->x_volume[x];
-				}
-			}
-			total -= cube->w_volume[w];
-		}
-	}
-	return NULL;
+	w_node->x_max = size;
 }
 
-inline void insert_w_node(struct cube *cube, unsigned short w)
+void place_x_axis(struct x_node *x_node, char *block, bsc_size size)
 {
-	struct w_node *w_node;
+	x_node->y_floor = (bsc_key *) block;
+	x_node->y_axis = (struct y_node **) (block + BSC_PTR_ROUND(size * sizeof(bsc_key)));
+	x_node->z_size = (unsigned char *) &x_node->y_axis[size];
 
-	++cube->w_size;
+	x_node->y_max = size;
+}
 
-	if (cube->w_size == cube->m_size)
-	{
-		cube->m_size += BSC_M;
+struct w_node *create_w_node(struct cube *cube, bsc_size size)
+{
+	struct w_node *w_node = (struct w_node *) bsc_alloc(cube, sizeof(struct w_node));
+
+	place_w_axis(w_node, (char *) bsc_alloc_line(cube, w_axis_size(size)), size);
+
+#if BSC_RANK
+	w_node->x_tree = NULL;
+	w_node->x_tree_max = 0;
+	w_node->x_ranked = 0;
+#endif
+#if BSC_EYTZ
+	w_node->x_eytz = NULL;
+	w_node->x_eytz_max = 0;
+	w_node->x_eytz_size = 0;
+#endif
+#if BSC_BUFFER
+	w_node->buf_keys = NULL;
+	w_node->buf_vals = NULL;
+	w_node->buf_size = w_node->buf_sort = 0;
+#endif
+#if BSC_MT
+	pthread_mutex_init(&w_node->lock, NULL);
+
+	w_node->seq = 0;
+#endif
+#if BSC_MVCC
+	w_node->gen = cube->gen;
+#endif
+	return w_node;
+}
 
-		cube->w_floor = (int *) realloc(cube->w_floor, cube->m_size * sizeof(int));
-		cube->w_axis = (struct w_node **) realloc(cube->w_axis, cube->m_size * sizeof(struct w_node *));
-		cube->w_volume = (int *) realloc(cube->w_volume, cube->m_size * sizeof(int));
-		cube->x_size = (unsigned short *) realloc(cube->x_size, cube->m_size * sizeof(unsigned short));
-	}
+void resize_w_node(struct cube *cube, struct w_node *w_node, bsc_size size)
+{
+	struct w_node old = *w_node;
+	bsc_size cnt = old.x_max < size ? old.x_max : size;
 
-	if (w + 1 != cube->w_size)
+	if (size == old.x_max)
 	{
-		memmove(&cube->w_floor[w + 1], &cube->w_floor[w], (cube->w_size - w - 1) * sizeof(int));
-		memmove(&cube->w_axis[w + 1], &cube->w_axis[w], (cube->w_size - w - 1) * sizeof(struct w_node *));
-		memmove(&cube->w_volume[w + 1], &cube->w_volume[w], (cube->w_size - w - 1) * sizeof(int));
-		memmove(&cube->x_size[w + 1], &cube->x_size[w], (cube->w_size - w - 1) * sizeof(unsigned short));
+		return;
 	}
+	place_w_axis(w_node, (char *) bsc_alloc_line(cube, w_axis_size(size)), size);
 
-	w_node = cube->w_axis[w] = (struct w_node *) malloc(sizeof(struct w_node));
+	memcpy(w_node->x_floor, old.x_floor, cnt * sizeof(bsc_key));
+	memcpy(w_node->x_axis, old.x_axis, cnt * sizeof(struct x_node *));
+	memcpy(w_node->x_volume, old.x_volume, cnt * sizeof(bsc_xvol));
+	memcpy(w_node->y_size, old.y_size, cnt * sizeof(bsc_size));
 
-	w_node->x_floor = (int *) malloc(cube->m_size * sizeof(int));
-	w_node->x_axis = (struct x_node **) malloc(cube->m_size * sizeof(struct x_node *));
-	w_node->y_size = (unsigned short *) malloc(cube->m_size * sizeof(unsigned short));
-	w_node->x_volume = (unsigned short *) malloc(cube->m_size * sizeof(unsigned short));
+	bsc_free(cube, old.x_floor, w_axis_size(old.x_max));
 }
 
-void remove_w_node(struct cube *cube, unsigned short w)
+void free_w_node(struct cube *cube, struct w_node *w_node)
 {
-	cube->w_size--;
+	BSC_RETIRE(cube, w_node->x_floor, w_axis_size(w_node->x_max), w_node->gen);
 
-	free(cube->w_axis[w]);
-
-	if (cube->w_size < cube->m_size - BSC_M)
+#if BSC_RANK
+	if (w_node->x_tree)
 	{
-		cube->m_size -= BSC_M;
+		bsc_free(cube, w_node->x_tree, w_node->x_tree_max * sizeof(bsc_vol));
 	}
-
-	if (cube->w_size)
+#endif
+#if BSC_EYTZ
+	if (w_node->x_eytz)
 	{
-		if (cube->w_size != w)
-		{
-			memmove(&cube->w_floor[w], &cube->w_floor[w + 1], (cube->w_size - w) * sizeof(int));
-			memmove(&cube->w_axis[w], &cube->w_axis[w + 1], (cube->w_size - w) * sizeof(struct w_node *));
-			memmove(&cube->w_volume[w], &cube->w_volume[w + 1], (cube->w_size - w) * sizeof(int));
-			memmove(&cube->x_size[w], &cube->x_size[w + 1], (cube->w_size - w) * sizeof(unsigned short));
-		}
+		bsc_free(cube, w_node->x_eytz, w_node->x_eytz_max * sizeof(bsc_key));
 	}
-	else
+#endif
+#if BSC_BUFFER
+	if (w_node->buf_keys)
 	{
-		free(cube->w_floor);
-		free(cube->w_axis);
-		free(cube->w_volume);
-		free(cube->x_size);
+		bsc_free(cube, w_node->buf_keys, BSC_BUFFER * sizeof(bsc_key));
+		bsc_free(cube, w_node->buf_vals, BSC_BUFFER * sizeof(bsc_val));
 	}
+#endif
+#if BSC_MT
+	pthread_mutex_destroy(&w_node->lock);
+#endif
+	BSC_RETIRE(cube, w_node, sizeof(struct w_node), w_node->gen);
 }
 
-inline void insert_x_node(struct cube *cube, unsigned short w, unsigned short x)
+struct x_node *create_x_node(struct cube *cube, bsc_size size)
 {
-	struct w_node *w_node = cube->w_axis[w];
-	struct x_node *x_node;
+	struct x_node *x_node = (struct x_node *) bsc_alloc(cube, sizeof(struct x_node));
 
-	unsigned short x_size = ++cube->x_size[w];
+	place_x_axis(x_node, (char *) bsc_alloc_line(cube, x_axis_size(size)), size);
 
-	if (x_size % BSC_M == 0 && x_size < cube->m_size)
-	{
-		w_node->x_floor = (int *) realloc(w_node->x_floor, cube->m_size * sizeof(int));
-		w_node->x_axis = (struct x_node **) realloc(w_node->x_axis, cube->m_size * sizeof(struct x_node *));
-		w_node->x_volume = (unsigned short *) realloc(w_node->x_volume, cube->m_size * sizeof(unsigned short));
-		w_node->y_size = (unsigned short *) realloc(w_node->y_size, cube->m_size * sizeof(unsigned short));
-	}
+#if BSC_MVCC
+	x_node->gen = cube->gen;
+#endif
+	return x_node;
+}
 
-	if (x_size != x + 1)
+void resize_x_node(struct cube *cube, struct x_node *x_node, bsc_size size)
+{
+	struct x_node old = *x_node;
+	bsc_size cnt = old.y_max < size ? old.y_max : size;
+
+	if (size == old.y_max)
 	{
-		memmove(&w_node->x_floor[x + 1], &w_node->x_floor[x], (x_size - x - 1) * sizeof(int));
-		memmove(&w_node->x_axis[x + 1], &w_node->x_axis[x], (x_size - x - 1) * sizeof(struct x_node *));
-		memmove(&w_node->x_volume[x + 1], &w_node->x_volume[x], (x_size - x - 1) * sizeof(unsigned short));
-		memmove(&w_node->y_size[x + 1], &w_node->y_size[x], (x_size - x - 1) * sizeof(unsigned short));
+		return;
 	}
+	place_x_axis(x_node, (char *) bsc_alloc_line(cube, x_axis_size(size)), size);
 
-	x_node = w_node->x_axis[x] = (struct x_node *) malloc(sizeof(struct x_node));
+	memcpy(x_node->y_floor, old.y_floor, cnt * sizeof(bsc_key));
+	memcpy(x_node->y_axis, old.y_axis, cnt * sizeof(struct y_node *));
+	memcpy(x_node->z_size, old.z_size, cnt * sizeof(unsigned char));
 
-	x_node->y_floor = (int *) malloc(cube->m_size * sizeof(int));
-	x_node->y_axis = (struct y_node **) malloc(cube->m_size * sizeof(struct y_node *));
-	x_node->z_size = (unsigned char *) malloc(cube->m_size * sizeof(unsigned char));
+	bsc_free(cube, old.y_floor, x_axis_size(old.y_max));
 }
 
-void remove_x_node(struct cube *cube, unsigned short w, unsigned short x)
+void free_x_node(struct cube *cube, struct x_node *x_node)
 {
-	struct w_node *w_node = cube->w_axis[w];
+	BSC_RETIRE(cube, x_node->y_floor, x_axis_size(x_node->y_max), x_node->gen);
 
-	cube->x_size[w]--;
+	BSC_RETIRE(cube, x_node, sizeof(struct x_node), x_node->gen);
+}
 
-	free(w_node->x_axis[x]);
+struct y_node *create_y_node(struct cube *cube)
+{
+	struct y_node *y_node = (struct y_node *) bsc_alloc(cube, sizeof(struct y_node));
 
-	if (cube->x_size[w])
+#if BSC_MVCC
+	y_node->gen = cube->gen;
+#endif
+	return y_node;
+}
+
+void free_y_node(struct cube *cube, struct y_node *y_node)
+{
+	BSC_RETIRE(cube, y_node, sizeof(struct y_node), y_node->gen);
+}
+
+#if BSC_MVCC
+
+// A block retired in generation g can only be reached by snapshots taken before g, so the retired list, which is
+// in generation order, is freed up to the oldest snapshot still held.
+
+void reclaim_blocks(struct cube *cube)
+{
+	struct cube *snap;
+	unsigned int oldest = ~0U;
+	size_t cnt;
+
+	pthread_mutex_lock(&cube->snap_lock);
+
+	__atomic_store_n(&cube->reclaim, 0, __ATOMIC_RELAXED);
+
+	for (snap = cube->snaps ; snap ; snap = snap->next_snap)
 	{
-		if (cube->x_size[w] != x)
+		if (snap->gen < oldest)
 		{
-			memmove(&w_node->x_floor[x], &w_node->x_floor[x + 1], (cube->x_size[w] - x ) * sizeof(int));
-			memmove(&w_node->x_axis[x], &w_node->x_axis[x + 1], (cube->x_size[w] - x ) * sizeof(struct x_node *));
-			memmove(&w_node->x_volume[x], &w_node->x_volume[x + 1], (cube->x_size[w] - x ) * sizeof(unsigned short));
-			memmove(&w_node->y_size[x], &w_node->y_size[x + 1], (cube->x_size[w] - x ) * sizeof(unsigned short));
+			oldest = snap->gen;
 		}
+	}
+	pthread_mutex_unlock(&cube->snap_lock);
 
-		if (x == 0)
-		{
-			cube->w_floor[w] = w_node->x_floor[0];
-		}
+	for (cnt = 0 ; cnt < cube->retired_size && cube->retired[cnt].gen <= oldest ; cnt++)
+	{
+		bsc_free(cube, cube->retired[cnt].ptr, cube->retired[cnt].size);
 	}
-	else
+
+	if (cnt)
 	{
-		remove_w_node(cube, w);
+		cube->retired_size -= cnt;
+
+		memmove(cube->retired, &cube->retired[cnt], cube->retired_size * sizeof(struct bsc_retired));
 	}
 }
 
-inline void insert_y_node(struct cube *cube, unsigned short w, unsigned short x, unsigned short y)
-{
-	struct x_node *x_node = cube->w_axis[w]->x_axis[x];
+// Nodes older than the current generation may be shared with a snapshot, the own calls copy such a node and every
+// axis above it before it is written, and return the copy that replaced it.
 
-	unsigned short y_size = ++cube->w_axis[w]->y_size[x];
+void own_cube_axis(struct cube *cube)
+{
+	bsc_key *w_floor;
+	struct w_node **w_axis;
+	bsc_vol *w_volume;
+	bsc_size *x_size;
+	bsc_size max = cube->w_max;
 
-	if (y_size % BSC_M == 0 && y_size < cube->m_size)
+	if (!node_shared(cube, cube->w_gen))
 	{
-		x_node->y_floor = (int *) realloc(x_node->y_floor, cube->m_size * sizeof(int));
-		x_node->y_axis = (struct y_node **) realloc(x_node->y_axis, cube->m_size * sizeof(struct y_node *));
-		x_node->z_size = (unsigned char *) realloc(x_node->z_size, cube->m_size * sizeof(unsigned char));
+		return;
 	}
 
-	if (y_size != y + 1)
+	if (max == 0)
 	{
-		memmove(&x_node->y_floor[y + 1], &x_node->y_floor[y], (y_size - y - 1) * sizeof(int));
-		memmove(&x_node->y_axis[y + 1], &x_node->y_axis[y], (y_size - y - 1) * sizeof(struct y_node *));
-		memmove(&x_node->z_size[y + 1], &x_node->z_size[y], (y_size - y - 1) * sizeof(unsigned char));
+		cube->w_gen = cube->gen;
+
+		return;
 	}
+	w_floor = (bsc_key *) bsc_alloc(cube, max * sizeof(bsc_key));
+	w_axis = (struct w_node **) bsc_alloc(cube, max * sizeof(struct w_node *));
+	w_volume = (bsc_vol *) bsc_alloc(cube, max * sizeof(bsc_vol));
+	x_size = (bsc_size *) bsc_alloc(cube, max * sizeof(bsc_size));
 
-	x_node->y_axis[y] = (struct y_node *) malloc(sizeof(struct y_node));
+	memcpy(w_floor, cube->w_floor, cube->w_size * sizeof(bsc_key));
+	memcpy(w_axis, cube->w_axis, cube->w_size * sizeof(struct w_node *));
+	memcpy(w_volume, cube->w_volume, cube->w_size * sizeof(bsc_vol));
+	memcpy(x_size, cube->x_size, cube->w_size * sizeof(bsc_size));
+
+	free_cube_axis(cube);
+
+	cube->w_floor = w_floor;
+	cube->w_axis = w_axis;
+	cube->w_volume = w_volume;
+	cube->x_size = x_size;
+
+	cube->w_max = max;
 }
 
-void remove_y_node(struct cube *cube, unsigned short w, unsigned short x, unsigned short y)
+struct w_node *own_w_node(struct cube *cube, bsc_size w)
 {
-	struct w_node *w_node = cube->w_axis[w];
-	struct x_node *x_node = w_node->x_axis[x];
+	struct w_node *w_node, *copy;
 
-	w_node->y_size[x]--;
+	own_cube_axis(cube);
 
-	free(x_node->y_axis[y]);
+	w_node = cube->w_axis[w];
 
-	if (w_node->y_size[x])
+	if (!node_shared(cube, w_node->gen))
 	{
-		if (w_node->y_size[x] != y)
-		{
-			memmove(&x_node->y_floor[y], &x_node->y_floor[y + 1], (w_node->y_size[x] - y ) * sizeof(int));
-			memmove(&x_node->y_axis[y], &x_node->y_axis[y + 1], (w_node->y_size[x] - y ) * sizeof(struct y_node *));
-			memmove(&x_node->z_size[y], &x_node->z_size[y + 1], (w_node->y_size[x] - y ) * sizeof(unsigned char));
-		}
+		return w_node;
+	}
+	copy = create_w_node(cube, w_node->x_max);
 
-		if (y == 0)
+	memcpy(copy->x_floor, w_node->x_floor, cube->x_size[w] * sizeof(bsc_key));
+	memcpy(copy->x_axis, w_node->x_axis, cube->x_size[w] * sizeof(struct x_node *));
+	memcpy(copy->y_size, w_node->y_size, cube->x_size[w] * sizeof(bsc_size));
+	memcpy(copy->x_volume, w_node->x_volume, cube->x_size[w] * sizeof(bsc_xvol));
+
+	free_w_node(cube, w_node);
+
+	return cube->w_axis[w] = copy;
+}
+
+struct x_node *own_x_node(struct cube *cube, bsc_size w, bsc_size x)
+{
+	struct w_node *w_node = own_w_node(cube, w);
+	struct x_node *x_node = w_node->x_axis[x], *copy;
+
+	if (!node_shared(cube, x_node->gen))
+	{
+		return x_node;
+	}
+	copy = create_x_node(cube, x_node->y_max);
+
+	memcpy(copy->y_floor, x_node->y_floor, w_node->y_size[x] * sizeof(bsc_key));
+	memcpy(copy->y_axis, x_node->y_axis, w_node->y_size[x] * sizeof(struct y_node *));
+	memcpy(copy->z_size, x_node->z_size, w_node->y_size[x] * sizeof(unsigned char));
+
+	free_x_node(cube, x_node);
+
+	return w_node->x_axis[x] = copy;
+}
+
+// Released snapshots are reclaimed here, every write reaches its Z axis through this call.
+
+struct y_node *own_y_node(struct cube *cube, bsc_size w, bsc_size x, bsc_size y)
+{
+	struct x_node *x_node;
+	struct y_node *y_node, *copy;
+
+	if (__atomic_load_n(&cube->reclaim, __ATOMIC_ACQUIRE))
+	{
+		reclaim_blocks(cube);
+	}
+	x_node = own_x_node(cube, w, x);
+	y_node = x_node->y_axis[y];
+
+	if (!node_shared(cube, y_node->gen))
+	{
+		return y_node;
+	}
+	copy = create_y_node(cube);
+
+	memcpy(copy->z_keys, y_node->z_keys, x_node->z_size[y] * sizeof(bsc_key));
+	memcpy(copy->z_vals, y_node->z_vals, x_node->z_size[y] * sizeof(bsc_val));
+
+	free_y_node(cube, y_node);
+
+	// a cursor holds the y_node it is on, the stamp sends it back to the axes for the copy
+
+	BSC_ADD(cube->stamp, 1);
+
+	return x_node->y_axis[y] = copy;
+}
+
+// Returns a read only view of the cube as it is now in O(1), usable with every call that does not change the cube.
+// The writer keeps changing the cube while other threads read the view, it is released with release_snapshot
+// before the cube is destroyed.
+
+struct cube *cube_snapshot(struct cube *cube)
+{
+	struct cube *snap = (struct cube *) malloc(sizeof(struct cube));
+
+	memcpy(snap, cube, sizeof(struct cube));
+
+	snap->origin = cube;
+	snap->snaps = NULL;
+	snap->retired = NULL;
+	snap->retired_size = snap->retired_max = 0;
+	snap->map = NULL;
+	snap->map_size = 0;
+
+	pthread_mutex_lock(&cube->snap_lock);
+
+	snap->next_snap = cube->snaps;
+	cube->snaps = snap;
+
+	pthread_mutex_unlock(&cube->snap_lock);
+
+	cube->gen++;
+
+	return snap;
+}
+
+// Can be called from any thread, the blocks only this view kept alive are freed by the writer's next change.
+
+void release_snapshot(struct cube *snap)
+{
+	struct cube *cube = snap->origin, **prev;
+
+	pthread_mutex_lock(&cube->snap_lock);
+
+	prev = &cube->snaps;
+
+	while (*prev != snap)
+	{
+		prev = &(*prev)->next_snap;
+	}
+	__atomic_store_n(prev, snap->next_snap, __ATOMIC_RELEASE);
+
+	pthread_mutex_unlock(&cube->snap_lock);
+
+	__atomic_store_n(&cube->reclaim, 1, __ATOMIC_RELEASE);
+
+	free(snap);
+}
+#endif
+
+struct cube *create_cube(void)
+{
+	struct cube *cube;
+
+	cube = (struct cube *) calloc(1, sizeof(struct cube));
+
+#if BSC_MT
+	pthread_mutex_init(&cube->pool.lock, NULL);
+	pthread_rwlock_init(&cube->lock, NULL);
+#endif
+#if BSC_MVCC
+	pthread_mutex_init(&cube->snap_lock, NULL);
+#endif
+
+	if (bsc_simd_level == -1)
+	{
+		init_simd();
+	}
+	return cube;
+}
+
+// With the pool every node lives in a slab, so only the slabs need to be released.
+
+void destroy_cube(struct cube *cube)
+{
+#if BSC_POOL
+	destroy_pool(&cube->pool);
+#else
+	if (cube->w_size)
+	{
+		struct w_node *w_node;
+		struct x_node *x_node;
+		struct y_node *y_node;
+
+		register bsc_size w, x, y;
+
+		for (w = 0 ; w < cube->w_size ; w++)
 		{
-			cube->w_axis[w]->x_floor[x] = x_node->y_floor[0];
+			w_node = cube->w_axis[w];
 
-			if (x == 0)
+			for (x = 0 ; x < cube->x_size[w] ; x++)
 			{
-				cube->w_floor[w] = x_node->y_floor[0];
+				x_node = w_node->x_axis[x];
+
+				for (y = 0 ; y < w_node->y_size[x] ; y++)
+				{
+					y_node = x_node->y_axis[y];
+
+					free_y_node(cube, y_node);
+				}
+				free_x_node(cube, x_node);
 			}
+			free_w_node(cube, w_node);
 		}
+		free_cube_axis(cube);
 	}
-	else
+#if BSC_MVCC
+	cube->snaps = NULL;
+
+	reclaim_blocks(cube);
+#endif
+#endif
+#if BSC_MT
+	pthread_mutex_destroy(&cube->pool.lock);
+	pthread_rwlock_destroy(&cube->lock);
+#endif
+#if BSC_MVCC
+	free(cube->retired);
+
+	pthread_mutex_destroy(&cube->snap_lock);
+#endif
+	if (cube->map)
 	{
-		remove_x_node(cube, w, x);
+		munmap(cube->map, cube->map_size);
 	}
+	free(cube);
 }
 
-inline void *remove_z_node(struct cube *cube, unsigned short w, unsigned short x, unsigned short y, unsigned short z)
+// Builds a cube from keys sorted in ascending order without duplicates, filling nodes to fill_factor.
+
+struct cube *cube_from_sorted(bsc_key *keys, bsc_val *vals, bsc_vol n, float fill_factor)
 {
-	struct w_node *w_node = cube->w_axis[w];
-	struct x_node *x_node = w_node->x_axis[x];
-	struct y_node *y_node = x_node->y_axis[y];
-	void *val;
+	struct cube *cube = create_cube();
+	struct w_node *w_node;
+	struct x_node *x_node;
+	struct y_node *y_node;
+	bsc_size m, per, w, x, y, w_cnt, x_cnt, y_cnt;
+	bsc_vol y_tot, x_tot, x_beg, x_end, y_beg, y_end, z_beg, z_end;
+	int z_per;
 
-	cube->volume--;
+	if (n <= 0)
+	{
+		return cube;
+	}
 
-	cube->w_volume[w]--;
-	w_node->x_volume[x]--;
+	if (fill_factor > 1.0f || fill_factor <= 0.0f)
+	{
+		fill_factor = 1.0f;
+	}
 
-	x_node->z_size[y]--;
+	z_per = fill_factor * BSC_Z_MAX;
 
-	val = y_node->z_vals[z];
+	z_per = z_per < 1 ? 1 : z_per > BSC_Z_MAX - 1 ? BSC_Z_MAX - 1 : z_per;
 
-	if (x_node->z_size[y] != z)
+	y_tot = (n + z_per - 1) / z_per;
+
+	// grow m until the w axis fits
+
+	for (m = BSC_M ; ; m += BSC_M)
 	{
-		memmove(&y_node->z_keys[z], &y_node->z_keys[z + 1], (x_node->z_size[y] - z) * sizeof(int));
-		memmove(&y_node->z_vals[z], &y_node->z_vals[z + 1], (x_node->z_size[y] - z) * sizeof(void *));
+		per = fill_factor * m;
+		per = per < 1 ? 1 : per > m - 1 ? m - 1 : per;
+
+		x_tot = (y_tot + per - 1) / per;
+
+		if ((x_tot + per - 1) / per < m)
+		{
+			break;
+		}
 	}
 
-	if (x_node->z_size[y])
+	cube->m_size = m;
+
+	resize_cube(cube, m);
+
+	cube->volume = n;
+	cube->w_size = w_cnt = (x_tot + per - 1) / per;
+
+	for (w = 0 ; w < w_cnt ; w++)
 	{
-		if (z == 0)
+		w_node = cube->w_axis[w] = create_w_node(cube, m);
+
+		x_beg = (long long) x_tot * w / w_cnt;
+		x_end = (long long) x_tot * (w + 1) / w_cnt;
+
+		cube->x_size[w] = x_cnt = x_end - x_beg;
+		cube->w_volume[w] = 0;
+
+		for (x = 0 ; x < x_cnt ; x++)
 		{
-			x_node->y_floor[y] = y_node->z_keys[z];
+			x_node = w_node->x_axis[x] = create_x_node(cube, m);
 
-			if (y == 0)
+			y_beg = (long long) y_tot * (x_beg + x) / x_tot;
+			y_end = (long long) y_tot * (x_beg + x + 1) / x_tot;
+
+			w_node->y_size[x] = y_cnt = y_end - y_beg;
+			w_node->x_volume[x] = 0;
+
+			for (y = 0 ; y < y_cnt ; y++)
 			{
-				w_node->x_floor[x] = y_node->z_keys[z];
+				y_node = x_node->y_axis[y] = create_y_node(cube);
 
-				if (x == 0)
-				{
-					cube->w_floor[w] = y_node->z_keys[z];
-				}
+				z_beg = (long long) n * (y_beg + y) / y_tot;
+				z_end = (long long) n * (y_beg + y + 1) / y_tot;
+
+				memcpy(y_node->z_keys, &keys[z_beg], (z_end - z_beg) * sizeof(bsc_key));
+				memcpy(y_node->z_vals, &vals[z_beg], (z_end - z_beg) * sizeof(bsc_val));
+
+				x_node->z_size[y] = z_end - z_beg;
+				x_node->y_floor[y] = keys[z_beg];
+
+				w_node->x_volume[x] += z_end - z_beg;
 			}
+			w_node->x_floor[x] = x_node->y_floor[0];
+
+			cube->w_volume[w] += w_node->x_volume[x];
 		}
+		cube->w_floor[w] = w_node->x_floor[0];
+	}
+#if BSC_EYTZ
+	refresh_eytz(cube);
+#endif
+	return cube;
+}
 
-		if (y && x_node->z_size[y] < BSC_Z_MIN && x_node->z_size[y - 1] < BSC_Z_MIN)
+// Copies the w range [w_beg, w_end) one z axis at a time, keys or vals may be NULL.
+
+bsc_vol copy_w_range(struct cube *cube, bsc_size w_beg, bsc_size w_end, bsc_key *keys, bsc_val *vals)
+{
+	struct w_node *w_node;
+	struct x_node *x_node;
+	struct y_node *y_node;
+	bsc_size w, x, y;
+	bsc_vol total = 0;
+
+	for (w = w_beg ; w < w_end ; w++)
+	{
+		w_node = cube->w_axis[w];
+
+		for (x = 0 ; x < cube->x_size[w] ; x++)
 		{
-			merge_y_node(cube, w, x, y - 1, y);
+			x_node = w_node->x_axis[x];
 
-			if (x && w_node->y_size[x] < cube->m_size / 4 && w_node->y_size[x - 1] < cube->m_size / 4)
+			for (y = 0 ; y < w_node->y_size[x] ; y++)
 			{
-				merge_x_node(cube, w, x - 1, x);
+				y_node = x_node->y_axis[y];
 
-				if (w && cube->x_size[w] < cube->m_size / 4 && cube->x_size[w - 1] < cube->m_size / 4)
+				if (keys)
 				{
-					merge_w_node(cube, w - 1, w);
+					memcpy(&keys[total], y_node->z_keys, x_node->z_size[y] * sizeof(bsc_key));
+				}
+				if (vals)
+				{
+					memcpy(&vals[total], y_node->z_vals, x_node->z_size[y] * sizeof(bsc_val));
 				}
+				total += x_node->z_size[y];
 			}
 		}
 	}
-	else
+	return total;
+}
+
+// Writes the cube in key order to arrays with room for cube->volume elements, returns the number written.
+
+bsc_vol cube_to_array(struct cube *cube, bsc_key *keys, bsc_val *vals)
+{
+	flush_cube(cube);
+
+	return copy_w_range(cube, 0, cube->w_size, keys, vals);
+}
+
+struct copy_job
+{
+	struct cube *cube;
+	bsc_size w_beg;
+	bsc_size w_end;
+	bsc_key *keys;
+	bsc_val *vals;
+};
+
+void *copy_job(void *arg)
+{
+	struct copy_job *job = (struct copy_job *) arg;
+
+	copy_w_range(job->cube, job->w_beg, job->w_end, job->keys, job->vals);
+
+	return NULL;
+}
+
+// Splits the w axis into ranges of roughly equal volume, each copied by its own thread at a precomputed offset.
+
+bsc_vol cube_to_array_mt(struct cube *cube, bsc_key *keys, bsc_val *vals, int threads)
+{
+	struct copy_job *jobs;
+	pthread_t *tids;
+	bsc_size w;
+	bsc_vol offset;
+	int cnt;
+
+	flush_cube(cube);
+
+	if (threads > cube->w_size)
 	{
-		remove_y_node(cube, w, x, y);
+		threads = cube->w_size;
 	}
-	return val;
+
+	if (threads <= 1)
+	{
+		return cube_to_array(cube, keys, vals);
+	}
+
+	jobs = (struct copy_job *) malloc(threads * sizeof(struct copy_job));
+	tids = (pthread_t *) malloc(threads * sizeof(pthread_t));
+
+	w = offset = 0;
+
+	for (cnt = 0 ; cnt < threads ; cnt++)
+	{
+		jobs[cnt].cube = cube;
+		jobs[cnt].w_beg = w;
+		jobs[cnt].keys = keys ? &keys[offset] : NULL;
+		jobs[cnt].vals = vals ? &vals[offset] : NULL;
+
+		while (w < cube->w_size && (offset < (long long) cube->volume * (cnt + 1) / threads || cnt + 1 == threads))
+		{
+			offset += cube->w_volume[w++];
+		}
+		jobs[cnt].w_end = w;
+	}
+
+	for (cnt = 1 ; cnt < threads ; cnt++)
+	{
+		pthread_create(&tids[cnt], NULL, copy_job, &jobs[cnt]);
+	}
+
+	copy_job(&jobs[0]);
+
+	for (cnt = 1 ; cnt < threads ; cnt++)
+	{
+		pthread_join(tids[cnt], NULL);
+	}
+	free(jobs);
+	free(tids);
+
+	return offset;
 }
 
-void split_w_node(struct cube *cube, unsigned short w)
+#if BSC_KEY != BSC_KEY_STR
+
+// A snapshot holds no pointers: a header, the w level, the x level flattened over all w_nodes, the y floors and
+// z sizes of every x_node padded to y_stride entries, then every y_node in key order, each section found by its
+// offset. cube_open_mmap maps the file privately and only rebuilds the w and x levels, copying the y floors and
+// z sizes into the x_nodes, whose Y axes point at the y_nodes inside the mapping. The kernel copies a page on its
+// first write, so the opened cube is writable. Values are stored as they are, pointer values only
+// mean something to a caller that uses them as handles.
+
+struct bsc_snapshot
 {
-	struct w_node *w_node1, *w_node2;
-	unsigned short x;
-	int volume;
+	char magic[8];
+	unsigned int key_size;
+	unsigned int val_size;
+	unsigned int size_size;
+	unsigned int xvol_size;
+	unsigned int z_max;
+	unsigned int node_size;
+	unsigned int m_size;
+	unsigned int y_stride;
+	long long volume;
+	long long w_size;
+	long long x_tot;
+	long long y_tot;
+};
 
-	insert_w_node(cube, w + 1);
+#define BSC_SNAP_ALIGN(size) (((size) + 63) / 64 * 64)
 
-	w_node1 = cube->w_axis[w];
-	w_node2 = cube->w_axis[w + 1];
+enum { SNAP_W_FLOOR, SNAP_X_SIZE, SNAP_W_VOLUME, SNAP_X_FLOOR, SNAP_Y_SIZE, SNAP_X_VOLUME, SNAP_Y_FLOOR, SNAP_Z_SIZE, SNAP_Y_NODES, SNAP_END };
+
+// Fills offsets[] with the start of every section, offsets[SNAP_END] is the file size.
+
+void snapshot_offsets(struct bsc_snapshot *snap, size_t *offsets)
+{
+	size_t sizes[SNAP_END];
+	int cnt;
+
+	sizes[SNAP_W_FLOOR] = snap->w_size * sizeof(bsc_key);
+	sizes[SNAP_X_SIZE] = snap->w_size * sizeof(bsc_size);
+	sizes[SNAP_W_VOLUME] = snap->w_size * sizeof(bsc_vol);
+	sizes[SNAP_X_FLOOR] = snap->x_tot * sizeof(bsc_key);
+	sizes[SNAP_Y_SIZE] = snap->x_tot * sizeof(bsc_size);
+	sizes[SNAP_X_VOLUME] = snap->x_tot * sizeof(bsc_xvol);
+	sizes[SNAP_Y_FLOOR] = snap->x_tot * snap->y_stride * sizeof(bsc_key);
+	sizes[SNAP_Z_SIZE] = snap->x_tot * snap->y_stride * sizeof(unsigned char);
+	sizes[SNAP_Y_NODES] = snap->y_tot * sizeof(struct y_node);
+
+	offsets[0] = BSC_SNAP_ALIGN(sizeof(struct bsc_snapshot));
+
+	for (cnt = 0 ; cnt < SNAP_END ; cnt++)
+	{
+		offsets[cnt + 1] = BSC_SNAP_ALIGN(offsets[cnt] + sizes[cnt]);
+	}
+}
+
+void snapshot_layout(struct bsc_snapshot *snap)
+{
+	memset(snap, 0, sizeof(struct bsc_snapshot));
+
+	memcpy(snap->magic, "BSCSNAP1", 8);
+
+	snap->key_size = sizeof(bsc_key);
+	snap->val_size = sizeof(bsc_val);
+	snap->size_size = sizeof(bsc_size);
+	snap->xvol_size = sizeof(bsc_xvol);
+	snap->z_max = BSC_Z_MAX;
+	snap->node_size = sizeof(struct y_node);
+}
+
+void snapshot_header(struct cube *cube, struct bsc_snapshot *snap)
+{
+	bsc_size w, x;
+
+	snapshot_layout(snap);
+
+	snap->m_size = cube->m_size;
+	snap->y_stride = cube->m_size;
+	snap->volume = cube->volume;
+	snap->w_size = cube->w_size;
+
+	for (w = 0 ; w < cube->w_size ; w++)
+	{
+		snap->x_tot += cube->x_size[w];
+
+		for (x = 0 ; x < cube->x_size[w] ; x++)
+		{
+			snap->y_tot += cube->w_axis[w]->y_size[x];
+
+			// an axis that outlived a shrinking m_size sets the stride, which keeps room for one more y_node
+
+			if (cube->w_axis[w]->y_size[x] >= snap->y_stride)
+			{
+				snap->y_stride = (cube->w_axis[w]->y_size[x] + BSC_M) / BSC_M * BSC_M;
+			}
+		}
+	}
+}
+
+// The file is sized up front and filled through a shared mapping, returns 0 on success and -1 on failure.
+
+int cube_save(struct cube *cube, const char *path)
+{
+	struct bsc_snapshot snap;
+	struct w_node *w_node;
+	struct x_node *x_node;
+	struct y_node *y_nodes;
+	size_t offsets[SNAP_END + 1];
+	bsc_key *x_floor, *y_floor;
+	bsc_size *y_size;
+	bsc_xvol *x_volume;
+	unsigned char *z_size;
+	bsc_size w, x, y;
+	long long x_cnt, y_cnt;
+	char *map;
+	int fd;
+
+	flush_cube(cube);
+
+	snapshot_header(cube, &snap);
+	snapshot_offsets(&snap, offsets);
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+	if (fd == -1)
+	{
+		return -1;
+	}
+
+	if (posix_fallocate(fd, 0, offsets[SNAP_END]) != 0)
+	{
+		close(fd);
+
+		return -1;
+	}
+
+	map = (char *) mmap(NULL, offsets[SNAP_END], PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+	close(fd);
+
+	if (map == MAP_FAILED)
+	{
+		return -1;
+	}
+
+	memcpy(map, &snap, sizeof(struct bsc_snapshot));
+
+	memcpy(map + offsets[SNAP_W_FLOOR], cube->w_floor, cube->w_size * sizeof(bsc_key));
+	memcpy(map + offsets[SNAP_X_SIZE], cube->x_size, cube->w_size * sizeof(bsc_size));
+	memcpy(map + offsets[SNAP_W_VOLUME], cube->w_volume, cube->w_size * sizeof(bsc_vol));
+
+	x_floor = (bsc_key *) (map + offsets[SNAP_X_FLOOR]);
+	y_size = (bsc_size *) (map + offsets[SNAP_Y_SIZE]);
+	x_volume = (bsc_xvol *) (map + offsets[SNAP_X_VOLUME]);
+	y_floor = (bsc_key *) (map + offsets[SNAP_Y_FLOOR]);
+	z_size = (unsigned char *) (map + offsets[SNAP_Z_SIZE]);
+	y_nodes = (struct y_node *) (map + offsets[SNAP_Y_NODES]);
+
+	for (w = x_cnt = y_cnt = 0 ; w < cube->w_size ; w++)
+	{
+		w_node = cube->w_axis[w];
+
+		memcpy(&x_floor[x_cnt], w_node->x_floor, cube->x_size[w] * sizeof(bsc_key));
+		memcpy(&y_size[x_cnt], w_node->y_size, cube->x_size[w] * sizeof(bsc_size));
+		memcpy(&x_volume[x_cnt], w_node->x_volume, cube->x_size[w] * sizeof(bsc_xvol));
+
+		for (x = 0 ; x < cube->x_size[w] ; x++, x_cnt++)
+		{
+			x_node = w_node->x_axis[x];
+
+			memcpy(&y_floor[x_cnt * snap.y_stride], x_node->y_floor, w_node->y_size[x] * sizeof(bsc_key));
+			memcpy(&z_size[x_cnt * snap.y_stride], x_node->z_size, w_node->y_size[x] * sizeof(unsigned char));
+
+			for (y = 0 ; y < w_node->y_size[x] ; y++)
+			{
+				memcpy(&y_nodes[y_cnt], x_node->y_axis[y], sizeof(struct y_node));
+#if BSC_MVCC
+				y_nodes[y_cnt].gen = 0;
+#endif
+				y_cnt++;
+			}
+		}
+	}
+	return munmap(map, offsets[SNAP_END]);
+}
+
+// The x axis of an opened w_node keeps room for one more x_node, as the insert paths expect of every axis.
+
+bsc_size snapshot_x_max(bsc_size size, bsc_size m_size)
+{
+	return size < m_size ? m_size : (size + BSC_M) / BSC_M * BSC_M;
+}
+
+// The header counts are checked before the offsets are computed, so they cannot overflow past the file size. A w
+// axis needs a free slot, insert_w_node only grows it once w_size reaches m_size.
+
+int check_snapshot_head(struct bsc_snapshot *head, size_t size)
+{
+	if (head->w_size < 0 || (head->w_size && head->w_size >= head->m_size) || head->m_size % BSC_M || head->volume < 0)
+	{
+		return -1;
+	}
+
+	if (head->y_stride % BSC_M || head->y_stride < head->m_size || (bsc_size) head->y_stride != head->y_stride)
+	{
+		return -1;
+	}
+
+	if (head->x_tot < head->w_size || head->y_tot < head->x_tot || head->x_tot > (long long) (size / (head->y_stride + 1)) || head->y_tot > (long long) (size / sizeof(struct y_node)))
+	{
+		return -1;
+	}
+	return 0;
+}
+
+// Checks every axis size against the totals in the header, the volumes against the z sizes, that the keys
+// ascend and that every floor is the first key below it, so a damaged file cannot make cube_open_mmap copy past an
+// axis, hand out y_nodes outside the mapping or send a search off the front of an axis.
+
+int check_snapshot(struct bsc_snapshot *head, char *map, size_t *offsets)
+{
+	bsc_key *w_floor = (bsc_key *) (map + offsets[SNAP_W_FLOOR]);
+	bsc_key *x_floor = (bsc_key *) (map + offsets[SNAP_X_FLOOR]);
+	bsc_key *y_floor = (bsc_key *) (map + offsets[SNAP_Y_FLOOR]);
+	struct y_node *y_nodes = (struct y_node *) (map + offsets[SNAP_Y_NODES]);
+	bsc_size *x_size = (bsc_size *) (map + offsets[SNAP_X_SIZE]);
+	bsc_vol *w_volume = (bsc_vol *) (map + offsets[SNAP_W_VOLUME]);
+	bsc_size *y_size = (bsc_size *) (map + offsets[SNAP_Y_SIZE]);
+	bsc_xvol *x_volume = (bsc_xvol *) (map + offsets[SNAP_X_VOLUME]);
+	unsigned char *z_size = (unsigned char *) (map + offsets[SNAP_Z_SIZE]);
+	long long w, x, y, z, x_cnt, y_cnt, volume, w_vol, x_vol;
+	bsc_key *z_keys, last;
+
+	for (w = x_cnt = y_cnt = volume = 0 ; w < head->w_size ; w++)
+	{
+		if (x_size[w] == 0 || x_size[w] > head->x_tot - x_cnt || x_size[w] >= snapshot_x_max(x_size[w], head->m_size))
+		{
+			return -1;
+		}
+
+		for (x = w_vol = 0 ; x < x_size[w] ; x++, x_cnt++)
+		{
+			if (y_size[x_cnt] == 0 || y_size[x_cnt] >= head->y_stride || y_size[x_cnt] > head->y_tot - y_cnt)
+			{
+				return -1;
+			}
+
+			for (y = x_vol = 0 ; y < y_size[x_cnt] ; y++, y_cnt++)
+			{
+				if (z_size[x_cnt * head->y_stride + y] == 0 || z_size[x_cnt * head->y_stride + y] >= BSC_Z_MAX)
+				{
+					return -1;
+				}
+				z_keys = y_nodes[y_cnt].z_keys;
+
+				if (!BSC_EQ(y_floor[x_cnt * head->y_stride + y], z_keys[0]))
+				{
+					return -1;
+				}
+
+				if (y == 0 && !BSC_EQ(x_floor[x_cnt], z_keys[0]))
+				{
+					return -1;
+				}
+
+				if (x == 0 && y == 0 && !BSC_EQ(w_floor[w], z_keys[0]))
+				{
+					return -1;
+				}
+
+				for (z = 0 ; z < z_size[x_cnt * head->y_stride + y] ; z++)
+				{
+					if ((y_cnt || z) && !BSC_LT(last, z_keys[z]))
+					{
+						return -1;
+					}
+					last = z_keys[z];
+				}
+				x_vol += z_size[x_cnt * head->y_stride + y];
+			}
+
+			if (x_vol != x_volume[x_cnt])
+			{
+				return -1;
+			}
+			w_vol += x_vol;
+		}
+
+		if (w_vol != w_volume[w])
+		{
+			return -1;
+		}
+		volume += w_vol;
+	}
+
+	if (x_cnt != head->x_tot || y_cnt != head->y_tot || volume != head->volume)
+	{
+		return -1;
+	}
+	return 0;
+}
+
+// Returns NULL when the file is missing, truncated, damaged or written by a build with a different layout.
+
+struct cube *cube_open_mmap(const char *path)
+{
+	struct bsc_snapshot snap, *head;
+	struct cube *cube;
+	struct w_node *w_node;
+	struct x_node *x_node;
+	struct y_node *y_nodes;
+	size_t offsets[SNAP_END + 1];
+	struct stat st;
+	bsc_key *x_floor, *y_floor;
+	bsc_size *y_size;
+	bsc_xvol *x_volume;
+	unsigned char *z_size;
+	bsc_size w, x, y;
+	long long x_cnt, y_cnt;
+	char *map;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+
+	if (fd == -1)
+	{
+		return NULL;
+	}
+
+	if (fstat(fd, &st) == -1 || (size_t) st.st_size < sizeof(struct bsc_snapshot))
+	{
+		close(fd);
+
+		return NULL;
+	}
+
+	map = (char *) mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+
+	close(fd);
+
+	if (map == MAP_FAILED)
+	{
+		return NULL;
+	}
+
+	head = (struct bsc_snapshot *) map;
+
+	snapshot_layout(&snap);
+
+	if (memcmp(head->magic, snap.magic, 8) || head->key_size != snap.key_size || head->val_size != snap.val_size || head->size_size != snap.size_size || head->xvol_size != snap.xvol_size || head->z_max != snap.z_max || head->node_size != snap.node_size)
+	{
+		munmap(map, st.st_size);
+
+		return NULL;
+	}
+
+	if (check_snapshot_head(head, st.st_size))
+	{
+		munmap(map, st.st_size);
+
+		return NULL;
+	}
+	snapshot_offsets(head, offsets);
+
+	if (offsets[SNAP_END] > (size_t) st.st_size || check_snapshot(head, map, offsets))
+	{
+		munmap(map, st.st_size);
+
+		return NULL;
+	}
+
+	cube = create_cube();
+
+	cube->map = map;
+	cube->map_size = st.st_size;
+
+	if (head->w_size == 0)
+	{
+		return cube;
+	}
+
+	cube->m_size = head->m_size;
+
+	resize_cube(cube, cube->m_size);
+
+	cube->w_size = head->w_size;
+	cube->volume = head->volume;
+
+	memcpy(cube->w_floor, map + offsets[SNAP_W_FLOOR], cube->w_size * sizeof(bsc_key));
+	memcpy(cube->x_size, map + offsets[SNAP_X_SIZE], cube->w_size * sizeof(bsc_size));
+	memcpy(cube->w_volume, map + offsets[SNAP_W_VOLUME], cube->w_size * sizeof(bsc_vol));
+
+	x_floor = (bsc_key *) (map + offsets[SNAP_X_FLOOR]);
+	y_size = (bsc_size *) (map + offsets[SNAP_Y_SIZE]);
+	x_volume = (bsc_xvol *) (map + offsets[SNAP_X_VOLUME]);
+	y_floor = (bsc_key *) (map + offsets[SNAP_Y_FLOOR]);
+	z_size = (unsigned char *) (map + offsets[SNAP_Z_SIZE]);
+	y_nodes = (struct y_node *) (map + offsets[SNAP_Y_NODES]);
+
+	for (w = x_cnt = y_cnt = 0 ; w < cube->w_size ; w++)
+	{
+		w_node = cube->w_axis[w] = create_w_node(cube, snapshot_x_max(cube->x_size[w], cube->m_size));
+
+		memcpy(w_node->x_floor, &x_floor[x_cnt], cube->x_size[w] * sizeof(bsc_key));
+		memcpy(w_node->y_size, &y_size[x_cnt], cube->x_size[w] * sizeof(bsc_size));
+		memcpy(w_node->x_volume, &x_volume[x_cnt], cube->x_size[w] * sizeof(bsc_xvol));
+
+		for (x = 0 ; x < cube->x_size[w] ; x++, x_cnt++)
+		{
+			x_node = w_node->x_axis[x] = create_x_node(cube, head->y_stride);
+
+			memcpy(x_node->y_floor, &y_floor[x_cnt * head->y_stride], w_node->y_size[x] * sizeof(bsc_key));
+			memcpy(x_node->z_size, &z_size[x_cnt * head->y_stride], w_node->y_size[x] * sizeof(unsigned char));
+
+			for (y = 0 ; y < w_node->y_size[x] ; y++)
+			{
+				x_node->y_axis[y] = &y_nodes[y_cnt++];
+			}
+		}
+	}
+#if BSC_EYTZ
+	refresh_eytz(cube);
+#endif
+	return cube;
+}
+#endif
+
+#if BSC_RANK
+
+// The trees are 1 based, an invalid tree is rebuilt in O(n) by the next query and ignored by updates.
+
+void build_tree(bsc_vol *tree, bsc_size size)
+{
+	bsc_size i, j;
+
+	for (i = 1 ; i <= size ; i++)
+	{
+		j = i + (i & -i);
+
+		if (j <= size)
+		{
+			tree[j] += tree[i];
+		}
+	}
+}
+
+void add_tree(bsc_vol *tree, bsc_size size, bsc_size i, int val)
+{
+	for (i++ ; i <= size ; i += i & -i)
+	{
+		tree[i] += val;
+	}
+}
+
+bsc_vol sum_tree(bsc_vol *tree, bsc_size i)
+{
+	bsc_vol sum = 0;
+
+	for ( ; i ; i -= i & -i)
+	{
+		sum += tree[i];
+	}
+	return sum;
+}
+
+// Returns the node holding *index and lowers *index by the volume of the preceding nodes.
+
+bsc_size find_tree(bsc_vol *tree, bsc_size size, bsc_vol *index)
+{
+	bsc_size pos = 0, step = 1;
+
+	while (step * 2 <= size)
+	{
+		step *= 2;
+	}
+
+	for ( ; step ; step /= 2)
+	{
+		if (pos + step <= size && tree[pos + step] <= *index)
+		{
+			pos += step;
+			*index -= tree[pos];
+		}
+	}
+	return pos;
+}
+
+bsc_vol *rank_w_tree(struct cube *cube)
+{
+	if (!cube->w_ranked)
+	{
+		if (cube->w_tree_max <= cube->w_size)
+		{
+			cube->w_tree = (bsc_vol *) bsc_realloc(cube, cube->w_tree, cube->w_tree_max * sizeof(bsc_vol), (cube->w_max + 1) * sizeof(bsc_vol));
+			cube->w_tree_max = cube->w_max + 1;
+		}
+		cube->w_tree[0] = 0;
+
+		memcpy(&cube->w_tree[1], cube->w_volume, cube->w_size * sizeof(bsc_vol));
+
+		build_tree(cube->w_tree, cube->w_size);
+
+		cube->w_ranked = 1;
+	}
+	return cube->w_tree;
+}
+
+bsc_vol *rank_x_tree(struct cube *cube, bsc_size w)
+{
+	struct w_node *w_node = cube->w_axis[w];
+	bsc_size x;
+
+	if (!w_node->x_ranked)
+	{
+		if (w_node->x_tree_max <= cube->x_size[w])
+		{
+			w_node->x_tree = (bsc_vol *) bsc_realloc(cube, w_node->x_tree, w_node->x_tree_max * sizeof(bsc_vol), (w_node->x_max + 1) * sizeof(bsc_vol));
+			w_node->x_tree_max = w_node->x_max + 1;
+		}
+		w_node->x_tree[0] = 0;
+
+		for (x = 0 ; x < cube->x_size[w] ; x++)
+		{
+			w_node->x_tree[x + 1] = w_node->x_volume[x];
+		}
+		build_tree(w_node->x_tree, cube->x_size[w]);
+
+		w_node->x_ranked = 1;
+	}
+	return w_node->x_tree;
+}
+
+void rank_add(struct cube *cube, bsc_size w, bsc_size x, int val)
+{
+	if (cube->w_ranked)
+	{
+		add_tree(cube->w_tree, cube->w_size, w, val);
+	}
+	if (cube->w_axis[w]->x_ranked)
+	{
+		add_tree(cube->w_axis[w]->x_tree, cube->x_size[w], x, val);
+	}
+}
+#endif
+
+#if BSC_EYTZ
+
+// Slots four levels below k share a cache line with 4 byte keys.
+
+#define BSC_EYTZ_AHEAD (64 / sizeof(bsc_key))
+
+// The tree is padded to 2^height - 1 slots with copies of the last key, so the position of a slot in key order
+// follows from its depth and offset.
+
+int eytz_height(bsc_size size)
+{
+	return 32 - __builtin_clz(size);
+}
+
+// Fills the slots below k in key order, returns the next position.
+
+unsigned int build_eytz(const bsc_key *keys, bsc_key *eytz, bsc_size size, unsigned int pos, unsigned int k, unsigned int slots)
+{
+	if (k <= slots)
+	{
+		pos = build_eytz(keys, eytz, size, pos, 2 * k, slots);
+
+		eytz[k] = keys[pos < size ? pos : size - 1U];
+		pos++;
+
+		pos = build_eytz(keys, eytz, size, pos, 2 * k + 1, slots);
+	}
+	return pos;
+}
+
+// The descent ends below the leaves, the trailing 1 bits of k are the right turns taken since the first key > key,
+// so shifting them out lands on that key. Returns the index of the key before it, keys[0] <= key is assumed.
+
+bsc_size search_eytz(const bsc_key *eytz, bsc_size size, bsc_key key)
+{
+	int height = eytz_height(size), depth;
+	unsigned int k = 1, slots = (1U << height) - 1;
+
+	while (k <= slots)
+	{
+		__builtin_prefetch(&eytz[k * BSC_EYTZ_AHEAD]);
+
+		k = 2 * k + !BSC_LT(key, eytz[k]);
+	}
+	k >>= __builtin_ffs(~k);
+
+	if (k == 0)
+	{
+		return size - 1;
+	}
+	depth = 31 - __builtin_clz(k);
+
+	return (((k - (1U << depth)) * 2 + 1) << (height - depth - 1)) - 2;
+}
+
+// A copy is only stale in the middle of a change, which rebuilds it before returning, the search falls back to
+// the floors then.
+
+bsc_size search_w_eytz(struct cube *cube, bsc_key key)
+{
+	if (cube->w_eytz_size != cube->w_size)
+	{
+		return search_wx(cube->w_floor, cube->w_size, key);
+	}
+	return search_eytz(cube->w_eytz, cube->w_size, key);
+}
+
+bsc_size search_x_eytz(struct cube *cube, bsc_size w, bsc_key key)
+{
+	struct w_node *w_node = cube->w_axis[w];
+
+	if (w_node->x_eytz_size != cube->x_size[w])
+	{
+		return search_wx(w_node->x_floor, cube->x_size[w], key);
+	}
+	return search_eytz(w_node->x_eytz, cube->x_size[w], key);
+}
+
+void build_w_eytz(struct cube *cube)
+{
+	unsigned int slots = 1U << eytz_height(cube->w_size);
+
+	if (cube->w_eytz_max < slots)
+	{
+		cube->w_eytz = (bsc_key *) bsc_realloc(cube, cube->w_eytz, cube->w_eytz_max * sizeof(bsc_key), slots * sizeof(bsc_key));
+		cube->w_eytz_max = slots;
+	}
+	build_eytz(cube->w_floor, cube->w_eytz, cube->w_size, 0, 1, slots - 1);
+
+	cube->w_eytz_size = cube->w_size;
+}
+
+void build_x_eytz(struct cube *cube, bsc_size w)
+{
+	struct w_node *w_node = cube->w_axis[w];
+	unsigned int slots = 1U << eytz_height(cube->x_size[w]);
+
+	if (w_node->x_eytz_max < slots)
+	{
+		w_node->x_eytz = (bsc_key *) bsc_realloc(cube, w_node->x_eytz, w_node->x_eytz_max * sizeof(bsc_key), slots * sizeof(bsc_key));
+		w_node->x_eytz_max = slots;
+	}
+	build_eytz(w_node->x_floor, w_node->x_eytz, cube->x_size[w], 0, 1, slots - 1);
+
+	w_node->x_eytz_size = cube->x_size[w];
+}
+
+// Called by BSC_REFRESH once a change is complete. Only splits, merges and new first keys at the start of an
+// x_node mark copies stale, so the walk over the w axis is rare.
+
+void refresh_eytz(struct cube *cube)
+{
+	bsc_size w;
+
+	cube->eytz_stale = 0;
+
+	if (cube->w_size == 0)
+	{
+		return;
+	}
+
+	if (cube->w_eytz_size != cube->w_size)
+	{
+		build_w_eytz(cube);
+	}
+
+	for (w = 0 ; w < cube->w_size ; w++)
+	{
+		if (cube->w_axis[w]->x_eytz_size != cube->x_size[w])
+		{
+			build_x_eytz(cube, w);
+		}
+	}
+}
+#endif
+
+// Number of elements stored in the w nodes before w.
+
+bsc_vol w_offset(struct cube *cube, bsc_size w)
+{
+#if BSC_RANK
+	return sum_tree(rank_w_tree(cube), w);
+#else
+	bsc_vol total = 0;
+
+	while (w--)
+	{
+		total += cube->w_volume[w];
+	}
+	return total;
+#endif
+}
+
+// Number of elements stored in the x nodes of w before x.
+
+bsc_vol x_offset(struct cube *cube, bsc_size w, bsc_size x)
+{
+#if BSC_RANK
+	return sum_tree(rank_x_tree(cube, w), x);
+#else
+	bsc_vol total = 0;
+
+	while (x--)
+	{
+		total += cube->w_axis[w]->x_volume[x];
+	}
+	return total;
+#endif
+}
+
+// Returns the number of keys smaller than key, which is the index of key when present.
+
+bsc_vol key_rank(struct cube *cube, bsc_key key)
+{
+	struct x_node *x_node;
+	bsc_size w, x, y, z;
+	bsc_vol total;
+
+	flush_cube(cube);
+
+	if (cube->w_size == 0)
+	{
+		return 0;
+	}
+
+	find_key(cube, key, &w, &x, &y, &z);
+
+	total = w_offset(cube, w) + x_offset(cube, w, x) + z;
+
+	x_node = cube->w_axis[w]->x_axis[x];
+
+	while (y--)
+	{
+		total += x_node->z_size[y];
+	}
+	return total;
+}
+
+// Returns the number of keys in [lo, hi].
+
+bsc_vol count_range(struct cube *cube, bsc_key lo, bsc_key hi)
+{
+	bsc_size w, x, y, z;
+	bsc_vol total;
+
+	if (BSC_LT(hi, lo))
+	{
+		return 0;
+	}
+
+	total = key_rank(cube, hi) - key_rank(cube, lo);
+
+	if (cube->w_size)
+	{
+		find_key(cube, hi, &w, &x, &y, &z);
+
+		if (z < cube->w_axis[w]->x_axis[x]->z_size[y] && BSC_EQ(cube->w_axis[w]->x_axis[x]->y_axis[y]->z_keys[z], hi))
+		{
+			total++;
+		}
+	}
+	return total;
+}
+
+void *get_index(struct cube *cube, bsc_vol index)
+{
+	bsc_size w, x, y, z;
+
+	flush_cube(cube);
+
+	return find_index(cube, index, &w, &x, &y, &z);
+}
+
+void *del_index(struct cube *cube, bsc_vol index)
+{
+	bsc_size w, x, y, z;
+
+	flush_cube(cube);
+
+	if (find_index(cube, index, &w, &x, &y, &z))
+	{
+		return remove_z_node(cube, w, x, y, z);
+	}
+	return NULL;
+}
+
+void set_index(struct cube *cube, bsc_vol index, void *val)
+{
+	bsc_size w, x, y, z;
+
+	flush_cube(cube);
+
+	if (find_index(cube, index, &w, &x, &y, &z))
+	{
+		BSC_SET_VAL(BSC_OWN_Y(cube, w, x, y)->z_vals[z], val);
+	}
+}
+
+void *get_key(struct cube *cube, bsc_key key)
+{
+	bsc_size w, x, y, z;
+#if BSC_BUFFER
+	struct w_node *w_node;
+	int b;
+
+	if (cube->buffered && cube->w_size && !BSC_LT(key, cube->w_floor[0]))
+	{
+		w_node = cube->w_axis[search_wx(cube->w_floor, cube->w_size, key)];
+
+		for (b = w_node->buf_size - 1 ; b >= w_node->buf_sort ; b--)
+		{
+			if (BSC_EQ(w_node->buf_keys[b], key))
+			{
+				return BSC_GET_VAL(w_node->buf_vals[b]);
+			}
+		}
+
+		if (w_node->buf_sort && !BSC_LT(key, w_node->buf_keys[0]))
+		{
+			b = search_wx(w_node->buf_keys, w_node->buf_sort, key);
+
+			if (BSC_EQ(w_node->buf_keys[b], key))
+			{
+				return BSC_GET_VAL(w_node->buf_vals[b]);
+			}
+		}
+	}
+#endif
+
+	return find_key(cube, key, &w, &x, &y, &z);
+}
+
+// Looks up n keys, a group of BSC_BATCH keys descends one level at a time while the next level of every key is prefetched.
+
+void get_key_batch(struct cube *cube, bsc_key *keys, int n, void **vals)
+{
+	struct w_node *w_nodes[BSC_BATCH];
+	struct x_node *x_nodes[BSC_BATCH];
+	struct y_node *y_nodes[BSC_BATCH];
+	bsc_size w[BSC_BATCH], x[BSC_BATCH], y[BSC_BATCH], z;
+	int beg, cnt, size;
+
+	flush_cube(cube);
+
+	for (beg = 0 ; beg < n ; beg += BSC_BATCH, keys += BSC_BATCH, vals += BSC_BATCH)
+	{
+		size = n - beg < BSC_BATCH ? n - beg : BSC_BATCH;
+
+		for (cnt = 0 ; cnt < size ; cnt++)
+		{
+			if (cube->w_size == 0 || BSC_LT(keys[cnt], cube->w_floor[0]))
+			{
+				w_nodes[cnt] = NULL;
+				continue;
+			}
+			w[cnt] = search_wx(cube->w_floor, cube->w_size, keys[cnt]);
+
+			w_nodes[cnt] = cube->w_axis[w[cnt]];
+
+			BSC_PREFETCH(w_nodes[cnt]);
+		}
+
+		for (cnt = 0 ; cnt < size ; cnt++)
+		{
+			if (w_nodes[cnt])
+			{
+				BSC_PREFETCH(w_nodes[cnt]->x_floor);
+				BSC_PREFETCH(w_nodes[cnt]->x_floor + cube->x_size[w[cnt]] / 2);
+			}
+		}
+
+		for (cnt = 0 ; cnt < size ; cnt++)
+		{
+			if (w_nodes[cnt])
+			{
+				x[cnt] = search_wx(w_nodes[cnt]->x_floor, cube->x_size[w[cnt]], keys[cnt]);
+
+				BSC_PREFETCH(&w_nodes[cnt]->x_axis[x[cnt]]);
+				BSC_PREFETCH(&w_nodes[cnt]->y_size[x[cnt]]);
+			}
+		}
+
+		for (cnt = 0 ; cnt < size ; cnt++)
+		{
+			if (w_nodes[cnt])
+			{
+				x_nodes[cnt] = w_nodes[cnt]->x_axis[x[cnt]];
+
+				BSC_PREFETCH(x_nodes[cnt]);
+			}
+		}
+
+		for (cnt = 0 ; cnt < size ; cnt++)
+		{
+			if (w_nodes[cnt])
+			{
+				BSC_PREFETCH(x_nodes[cnt]->y_floor);
+				BSC_PREFETCH(x_nodes[cnt]->y_floor + w_nodes[cnt]->y_size[x[cnt]] / 2);
+				BSC_PREFETCH(x_nodes[cnt]->z_size);
+			}
+		}
+
+		for (cnt = 0 ; cnt < size ; cnt++)
+		{
+			if (w_nodes[cnt])
+			{
+				y[cnt] = search_y(x_nodes[cnt]->y_floor, w_nodes[cnt]->y_size[x[cnt]], keys[cnt]);
+
+				BSC_PREFETCH(&x_nodes[cnt]->y_axis[y[cnt]]);
+			}
+		}
+
+		for (cnt = 0 ; cnt < size ; cnt++)
+		{
+			if (w_nodes[cnt])
+			{
+				y_nodes[cnt] = x_nodes[cnt]->y_axis[y[cnt]];
+
+				BSC_PREFETCH(y_nodes[cnt]->z_keys);
+				BSC_PREFETCH(y_nodes[cnt]->z_keys + BSC_Z_MAX / 2);
+			}
+		}
+
+		for (cnt = 0 ; cnt < size ; cnt++)
+		{
+			if (w_nodes[cnt])
+			{
+				z = search_z(y_nodes[cnt]->z_keys, x_nodes[cnt]->z_size[y[cnt]], keys[cnt]);
+
+				vals[cnt] = BSC_EQ(keys[cnt], y_nodes[cnt]->z_keys[z]) ? BSC_GET_VAL(y_nodes[cnt]->z_vals[z]) : NULL;
+			}
+			else
+			{
+				vals[cnt] = NULL;
+			}
+		}
+	}
+}
+
+void *del_key(struct cube *cube, bsc_key key)
+{
+	bsc_size w, x, y, z;
+
+#if BSC_BUFFER
+	if (cube->buffered && cube->w_size && !BSC_LT(key, cube->w_floor[0]))
+	{
+		flush_buffer(cube, search_wx(cube->w_floor, cube->w_size, key));
+	}
+#endif
+
+	if (find_key(cube, key, &w, &x, &y, &z))
+	{
+		return remove_z_node(cube, w, x, y, z);
+	}
+	return NULL;
+}
+
+void set_key(struct cube *cube, bsc_key key, void *val)
+{
+	struct w_node *w_node;
+	struct x_node *x_node;
+	struct y_node *y_node;
+
+	bsc_size w, x, y, z;
+
+#if BSC_BUFFER
+	if (cube->w_size && !BSC_LT(key, cube->w_floor[0]))
+	{
+		buffer_key(cube, search_wx(cube->w_floor, cube->w_size, key), key, val);
+
+		return;
+	}
+
+	// a new floor is inserted directly and may split the first w_node, whose buffer must be empty for that
+
+	if (cube->w_size && cube->w_axis[0]->buf_size)
+	{
+		flush_buffer(cube, 0);
+	}
+#endif
+
+	if (cube->w_size == 0)
+	{
+		cube->m_size = BSC_M;
+
+		resize_cube(cube, BSC_M);
+
+		w_node = cube->w_axis[0] = create_w_node(cube, BSC_M);
+
+		x_node = w_node->x_axis[0] = create_x_node(cube, BSC_M);
+
+		y_node = x_node->y_axis[0] = create_y_node(cube);
+
+		x_node->z_size[0] = 0;
+
+		cube->w_size = cube->x_size[0] = w_node->y_size[0] = 1;
+		cube->volume = cube->w_volume[0] = w_node->x_volume[0] = 0;
+
+		w = x = y = z = 0;
+
+		cube->w_floor[0] = w_node->x_floor[0] = x_node->y_floor[0] = key;
+
+		BSC_STALE_W(cube);
+		BSC_STALE_X(cube, w_node);
+
+		goto insert;
+	}
+
+	if (BSC_LT(key, cube->w_floor[0]))
+	{
+		y_node = BSC_OWN_Y(cube, 0, 0, 0);
+		w_node = cube->w_axis[0];
+		x_node = w_node->x_axis[0];
+
+		w = x = y = z = 0;
+
+		cube->w_floor[0] = w_node->x_floor[0] = x_node->y_floor[0] = key;
+
+		BSC_STALE_W(cube);
+		BSC_STALE_X(cube, w_node);
+
+		goto insert;
+	}
+
+	// w
+
+	w = BSC_SEARCH_W(cube, key);
+
+	w_node = cube->w_axis[w];
+
+	// x
+
+	x = BSC_SEARCH_X(cube, w, key);
+
+	x_node = w_node->x_axis[x];
+
+	// y
+
+	y = search_y(x_node->y_floor, w_node->y_size[x], key);
+
+	y_node = x_node->y_axis[y];
+
+	// z
+
+	z = search_z(y_node->z_keys, x_node->z_size[y], key);
+
+	if (BSC_EQ(key, y_node->z_keys[z]))
+	{
+		BSC_SET_VAL(BSC_OWN_Y(cube, w, x, y)->z_vals[z], val);
+
+		return;
+	}
+
+	++z;
+
+	insert:
+
+	insert_z_node(cube, w, x, y, z, key, val);
+}
+
+#if BSC_MT
+
+// A writer makes a count odd while it changes what the count guards, a reader that saw an odd or a changed count
+// retries. The fences keep the guarded stores and loads between the two reads or writes of the count.
+
+unsigned int seq_read(unsigned int *seq)
+{
+	unsigned int cnt;
+
+	while ((cnt = __atomic_load_n(seq, __ATOMIC_ACQUIRE)) & 1)
+	{
+		sched_yield();
+	}
+	return cnt;
+}
+
+int seq_changed(unsigned int *seq, unsigned int cnt)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+	return __atomic_load_n(seq, __ATOMIC_RELAXED) != cnt;
+}
+
+void seq_begin(unsigned int *seq)
+{
+	__atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void seq_end(unsigned int *seq)
+{
+	__atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+}
+
+int mt_changed(struct cube *cube, unsigned int c_seq, struct w_node *w_node, unsigned int w_seq)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+	return __atomic_load_n(&cube->seq, __ATOMIC_RELAXED) != c_seq || __atomic_load_n(&w_node->seq, __ATOMIC_RELAXED) != w_seq;
+}
+
+// Returns the index of the last key <= key or 0, keys past size - 1 are never read, so an axis that changes
+// during the search gives a wrong index rather than a stray read.
+
+bsc_size search_mt(const bsc_key *keys, bsc_size size, bsc_key key)
+{
+	bsc_size lo = 0, hi = size, mid;
+
+	while (hi - lo > 1)
+	{
+		mid = lo + (hi - lo) / 2;
+
+		if (BSC_LT(key, keys[mid]))
+		{
+			hi = mid;
+		}
+		else
+		{
+			lo = mid;
+		}
+	}
+	return lo;
+}
+
+// Lock free lookup, every size and pointer is validated against the counts before it is used.
+
+void *get_key_mt(struct cube *cube, bsc_key key)
+{
+	struct w_node *w_node;
+	struct x_node *x_node;
+	struct y_node *y_node;
+	bsc_key *floor;
+	bsc_size w, x, y, z, size;
+	unsigned int c_seq, w_seq;
+	void *val;
+
+	retry:
+
+	c_seq = seq_read(&cube->seq);
+
+	size = cube->w_size;
+	floor = cube->w_floor;
+
+	if (seq_changed(&cube->seq, c_seq))
+	{
+		goto retry;
+	}
+
+	if (size == 0 || BSC_LT(key, floor[0]))
+	{
+		if (seq_changed(&cube->seq, c_seq))
+		{
+			goto retry;
+		}
+		return NULL;
+	}
+
+	// w
+
+	w = search_mt(floor, size, key);
+
+	w_node = cube->w_axis[w];
+
+	if (seq_changed(&cube->seq, c_seq))
+	{
+		goto retry;
+	}
+
+	w_seq = __atomic_load_n(&w_node->seq, __ATOMIC_ACQUIRE);
+
+	if (w_seq & 1)
+	{
+		sched_yield();
+
+		goto retry;
+	}
+
+	// x
+
+	size = cube->x_size[w];
+	floor = w_node->x_floor;
+
+	if (mt_changed(cube, c_seq, w_node, w_seq))
+	{
+		goto retry;
+	}
+
+	x = search_mt(floor, size, key);
+
+	x_node = w_node->x_axis[x];
+
+	if (mt_changed(cube, c_seq, w_node, w_seq))
+	{
+		goto retry;
+	}
+
+	// y
+
+	size = w_node->y_size[x];
+	floor = x_node->y_floor;
+
+	if (mt_changed(cube, c_seq, w_node, w_seq))
+	{
+		goto retry;
+	}
+
+	y = search_mt(floor, size, key);
+
+	y_node = x_node->y_axis[y];
+
+	size = x_node->z_size[y];
+
+	if (mt_changed(cube, c_seq, w_node, w_seq))
+	{
+		goto retry;
+	}
+
+	// z
+
+#if BSC_X86
+	// the simd searches read a fixed block of the node and at worst return an index out of range
+
+	z = bsc_simd_level ? search_z(y_node->z_keys, size, key) : search_mt(y_node->z_keys, size, key);
+#else
+	z = search_mt(y_node->z_keys, size, key);
+#endif
+	val = z < size && BSC_EQ(key, y_node->z_keys[z]) ? y_node->z_vals[z] : NULL;
+
+	if (mt_changed(cube, c_seq, w_node, w_seq))
+	{
+		goto retry;
+	}
+	return val;
+}
+
+// Inserts under the mutex of the w_node, a key below the cube's floor or an insert that would split the w_node
+// is passed to set_key under the exclusive cube lock.
+
+void set_key_mt(struct cube *cube, bsc_key key, void *val)
+{
+	struct w_node *w_node;
+	struct x_node *x_node;
+	struct y_node *y_node;
+	bsc_size w, x, y, z;
+	int done = 0;
+
+	pthread_rwlock_rdlock(&cube->lock);
+
+	if (cube->w_size && !BSC_LT(key, cube->w_floor[0]))
+	{
+		w = search_wx(cube->w_floor, cube->w_size, key);
+
+		w_node = cube->w_axis[w];
+
+		pthread_mutex_lock(&w_node->lock);
+
+		x = search_wx(w_node->x_floor, cube->x_size[w], key);
+
+		x_node = w_node->x_axis[x];
+
+		y = search_y(x_node->y_floor, w_node->y_size[x], key);
+
+		y_node = x_node->y_axis[y];
+
+		z = search_z(y_node->z_keys, x_node->z_size[y], key);
+
+		if (BSC_EQ(key, y_node->z_keys[z]))
+		{
+			seq_begin(&w_node->seq);
+
+			y_node->z_vals[z] = val;
+
+			seq_end(&w_node->seq);
+
+			done = 1;
+		}
+		else if (x_node->z_size[y] < BSC_Z_MAX - 1 || w_node->y_size[x] < cube->m_size - 1 || cube->x_size[w] < cube->m_size - 1)
+		{
+			seq_begin(&w_node->seq);
+
+			insert_z_node(cube, w, x, y, z + 1, key, val);
+
+			seq_end(&w_node->seq);
+
+			done = 1;
+		}
+		pthread_mutex_unlock(&w_node->lock);
+	}
+	pthread_rwlock_unlock(&cube->lock);
+
+	if (!done)
+	{
+		pthread_rwlock_wrlock(&cube->lock);
+		seq_begin(&cube->seq);
+
+		set_key(cube, key, val);
+
+		seq_end(&cube->seq);
+		pthread_rwlock_unlock(&cube->lock);
+	}
+}
+
+// Removes under the mutex of the w_node unless the key is the w_node's floor or a merge could reach the w axis.
+
+void *del_key_mt(struct cube *cube, bsc_key key)
+{
+	struct w_node *w_node;
+	struct x_node *x_node;
+	struct y_node *y_node;
+	bsc_size w, x, y, z;
+	void *val = NULL;
+	int done = 1;
+
+	pthread_rwlock_rdlock(&cube->lock);
+
+	if (cube->w_size && !BSC_LT(key, cube->w_floor[0]))
+	{
+		w = search_wx(cube->w_floor, cube->w_size, key);
+
+		w_node = cube->w_axis[w];
+
+		pthread_mutex_lock(&w_node->lock);
+
+		x = search_wx(w_node->x_floor, cube->x_size[w], key);
+
+		x_node = w_node->x_axis[x];
+
+		y = search_y(x_node->y_floor, w_node->y_size[x], key);
+
+		y_node = x_node->y_axis[y];
+
+		z = search_z(y_node->z_keys, x_node->z_size[y], key);
+
+		if (BSC_EQ(key, y_node->z_keys[z]))
+		{
+			if ((x || y || z) && cube->x_size[w] > cube->m_size / 4)
+			{
+				seq_begin(&w_node->seq);
+
+				val = remove_z_node(cube, w, x, y, z);
+
+				seq_end(&w_node->seq);
+			}
+			else
+			{
+				done = 0;
+			}
+		}
+		pthread_mutex_unlock(&w_node->lock);
+	}
+	pthread_rwlock_unlock(&cube->lock);
+
+	if (!done)
+	{
+		pthread_rwlock_wrlock(&cube->lock);
+		seq_begin(&cube->seq);
+
+		val = del_key(cube, key);
+
+		seq_end(&cube->seq);
+		pthread_rwlock_unlock(&cube->lock);
+	}
+	return val;
+}
+#endif
+
+// Range partitioned cubes for parallel ingest. Shard i holds the keys from splits[i - 1] up to splits[i] and is only
+// written by its own worker, which drains one single producer ring per producer thread into the shard's cube. Reads
+// go to the owning shard under its rwlock. shard_flush waits for the rings to drain and must not overlap with
+// shard_set_key, when the shard volumes have drifted apart it rebuilds the shards around new split keys.
+
+#define BSC_RING_SIZE 4096
+
+struct bsc_ring
+{
+	unsigned int head __attribute__((aligned(64)));
+	unsigned int tail __attribute__((aligned(64)));
+	bsc_key keys[BSC_RING_SIZE];
+	bsc_val vals[BSC_RING_SIZE];
+};
+
+struct shard
+{
+	struct cube *cube;
+	struct shard_cube *owner;
+	struct bsc_ring **rings;
+	pthread_rwlock_t lock;
+	pthread_t thread;
+};
+
+struct shard_cube
+{
+	struct shard *shards;
+	bsc_key *splits;
+	int split_size;
+	int size;
+	int producers;
+	int stop;
+	pthread_rwlock_t lock;
+};
+
+// Returns the number of split keys <= key, before the first rebalance without splits everything goes to shard 0.
+
+int route_shard(struct shard_cube *sc, bsc_key key)
+{
+	int lo = 0, hi = sc->split_size, mid;
+
+	while (lo < hi)
+	{
+		mid = (lo + hi) / 2;
+
+		if (BSC_LT(key, sc->splits[mid]))
+		{
+			hi = mid;
+		}
+		else
+		{
+			lo = mid + 1;
+		}
+	}
+	return lo;
+}
+
+// A batch is every entry between tail and head, applied under one write lock and released by advancing tail.
+
+void *shard_worker(void *arg)
+{
+	struct shard *shard = (struct shard *) arg;
+	struct shard_cube *sc = shard->owner;
+	struct bsc_ring *ring;
+	struct timespec nap = { 0, 50000 };
+	unsigned int head, tail;
+	int cnt, idle = 0;
+
+	while (!__atomic_load_n(&sc->stop, __ATOMIC_ACQUIRE))
+	{
+		for (cnt = 0 ; cnt < sc->producers ; cnt++)
+		{
+			ring = shard->rings[cnt];
+
+			tail = ring->tail;
+			head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+			if (head == tail)
+			{
+				continue;
+			}
+			idle = 0;
+
+			pthread_rwlock_wrlock(&shard->lock);
+
+			while (tail != head)
+			{
+				set_key(shard->cube, ring->keys[tail % BSC_RING_SIZE], BSC_GET_VAL(ring->vals[tail % BSC_RING_SIZE]));
+
+				tail++;
+			}
+			pthread_rwlock_unlock(&shard->lock);
+
+			__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+		}
+
+		if (++idle > 100)
+		{
+			nanosleep(&nap, NULL);
+		}
+		else if (idle > 1)
+		{
+			sched_yield();
+		}
+	}
+	return NULL;
+}
+
+// splits holds size - 1 ascending keys or is NULL, in which case the first shard_flush picks them.
+
+struct shard_cube *create_shard_cube(int size, int producers, bsc_key *splits)
+{
+	struct shard_cube *sc;
+	struct shard *shard;
+	int cnt, ring;
+
+	sc = (struct shard_cube *) calloc(1, sizeof(struct shard_cube));
+
+	sc->size = size;
+	sc->producers = producers;
+	sc->shards = (struct shard *) calloc(size, sizeof(struct shard));
+	sc->splits = (bsc_key *) calloc(size, sizeof(bsc_key));
+
+	if (splits)
+	{
+		memcpy(sc->splits, splits, (size - 1) * sizeof(bsc_key));
+
+		sc->split_size = size - 1;
+	}
+	pthread_rwlock_init(&sc->lock, NULL);
+
+	for (cnt = 0 ; cnt < size ; cnt++)
+	{
+		shard = &sc->shards[cnt];
+
+		shard->cube = create_cube();
+		shard->owner = sc;
+		shard->rings = (struct bsc_ring **) malloc(producers * sizeof(struct bsc_ring *));
+
+		for (ring = 0 ; ring < producers ; ring++)
+		{
+			shard->rings[ring] = (struct bsc_ring *) aligned_alloc(64, sizeof(struct bsc_ring));
+			shard->rings[ring]->head = shard->rings[ring]->tail = 0;
+		}
+		pthread_rwlock_init(&shard->lock, NULL);
+
+		pthread_create(&shard->thread, NULL, shard_worker, shard);
+	}
+	return sc;
+}
+
+// Each producer thread passes its own index, so every ring has a single producer. Blocks while the ring is full.
+
+void shard_set_key(struct shard_cube *sc, int producer, bsc_key key, void *val)
+{
+	struct bsc_ring *ring = sc->shards[route_shard(sc, key)].rings[producer];
+	unsigned int head = ring->head;
+
+	while (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == BSC_RING_SIZE)
+	{
+		sched_yield();
+	}
+	ring->keys[head % BSC_RING_SIZE] = key;
+
+	BSC_SET_VAL(ring->vals[head % BSC_RING_SIZE], val);
+
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// Keys still queued in a ring are not visible until the shard's worker has applied them.
+
+void *shard_get_key(struct shard_cube *sc, bsc_key key)
+{
+	struct shard *shard;
+	void *val;
+
+	pthread_rwlock_rdlock(&sc->lock);
+
+	shard = &sc->shards[route_shard(sc, key)];
+
+	pthread_rwlock_rdlock(&shard->lock);
+
+	val = get_key(shard->cube, key);
+
+	pthread_rwlock_unlock(&shard->lock);
+
+	pthread_rwlock_unlock(&sc->lock);
+
+	return val;
+}
+
+bsc_vol shard_volume(struct shard_cube *sc)
+{
+	bsc_vol total = 0;
+	int cnt;
+
+	for (cnt = 0 ; cnt < sc->size ; cnt++)
+	{
+		total += sc->shards[cnt].cube->volume;
+	}
+	return total;
+}
+
+// The shards cover ascending key ranges, so their arrays concatenate in key order and are cut into equal slices.
+
+void rebalance_shards(struct shard_cube *sc)
+{
+	bsc_key *keys;
+	bsc_val *vals;
+	bsc_vol total, beg, end;
+	int cnt;
+
+	total = shard_volume(sc);
+
+	keys = (bsc_key *) malloc(total * sizeof(bsc_key));
+	vals = (bsc_val *) malloc(total * sizeof(bsc_val));
+
+	for (cnt = 0, beg = 0 ; cnt < sc->size ; cnt++)
+	{
+		beg += cube_to_array(sc->shards[cnt].cube, &keys[beg], &vals[beg]);
+
+		destroy_cube(sc->shards[cnt].cube);
+	}
+
+	for (cnt = 0 ; cnt < sc->size ; cnt++)
+	{
+		beg = (long long) total * cnt / sc->size;
+		end = (long long) total * (cnt + 1) / sc->size;
+
+		// leave room in the nodes for the ingest that follows
+
+		sc->shards[cnt].cube = cube_from_sorted(&keys[beg], &vals[beg], end - beg, 0.75f);
+
+		if (cnt)
+		{
+			sc->splits[cnt - 1] = keys[beg];
+		}
+	}
+	sc->split_size = sc->size - 1;
+
+	free(keys);
+	free(vals);
+}
+
+void drain_shards(struct shard_cube *sc)
+{
+	struct bsc_ring *ring;
+	int cnt, producer;
+
+	for (cnt = 0 ; cnt < sc->size ; cnt++)
+	{
+		for (producer = 0 ; producer < sc->producers ; producer++)
+		{
+			ring = sc->shards[cnt].rings[producer];
+
+			while (__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) != ring->head)
+			{
+				sched_yield();
+			}
+		}
+	}
+}
+
+// Waits until every ring is drained, then rebalances when the volume spread exceeds the average shard volume.
+
+void shard_flush(struct shard_cube *sc)
+{
+	bsc_vol total, min, max, volume;
+	int cnt;
+
+	drain_shards(sc);
+
+	pthread_rwlock_wrlock(&sc->lock);
+
+	// buffered keys only count once they are flushed
+
+	for (cnt = 0 ; cnt < sc->size ; cnt++)
+	{
+		flush_cube(sc->shards[cnt].cube);
+	}
+	total = min = shard_volume(sc);
+	max = 0;
+
+	for (cnt = 0 ; cnt < sc->size ; cnt++)
+	{
+		volume = sc->shards[cnt].cube->volume;
+
+		min = volume < min ? volume : min;
+		max = volume > max ? volume : max;
+	}
+
+	if (sc->size > 1 && total >= sc->size && max - min > total / sc->size)
+	{
+		rebalance_shards(sc);
+	}
+	pthread_rwlock_unlock(&sc->lock);
+}
+
+void destroy_shard_cube(struct shard_cube *sc)
+{
+	int cnt, ring;
+
+	drain_shards(sc);
+
+	__atomic_store_n(&sc->stop, 1, __ATOMIC_RELEASE);
+
+	for (cnt = 0 ; cnt < sc->size ; cnt++)
+	{
+		pthread_join(sc->shards[cnt].thread, NULL);
+
+		destroy_cube(sc->shards[cnt].cube);
+
+		for (ring = 0 ; ring < sc->producers ; ring++)
+		{
+			free(sc->shards[cnt].rings[ring]);
+		}
+		free(sc->shards[cnt].rings);
+
+		pthread_rwlock_destroy(&sc->shards[cnt].lock);
+	}
+	pthread_rwlock_destroy(&sc->lock);
+
+	free(sc->shards);
+	free(sc->splits);
+	free(sc);
+}
+
+// Priority queue calls, both ends of the cube are reached without a search.
+
+void push(struct cube *cube, bsc_key key, void *val)
+{
+	bsc_size w, x, y;
+
+	flush_cube(cube);
+
+	if (cube->w_size)
+	{
+		w = cube->w_size - 1;
+		x = cube->x_size[w] - 1;
+		y = cube->w_axis[w]->y_size[x] - 1;
+
+		if (BSC_LT(cube->w_axis[w]->x_axis[x]->y_axis[y]->z_keys[cube->w_axis[w]->x_axis[x]->z_size[y] - 1], key))
+		{
+			insert_z_node(cube, w, x, y, cube->w_axis[w]->x_axis[x]->z_size[y], key, val);
+
+			return;
+		}
+	}
+	set_key(cube, key, val);
+}
+
+void *peek_min(struct cube *cube, bsc_key *key)
+{
+	struct y_node *y_node;
+
+	flush_cube(cube);
+
+	if (cube->volume == 0)
+	{
+		return NULL;
+	}
+	y_node = cube->w_axis[0]->x_axis[0]->y_axis[0];
+
+	if (key)
+	{
+		*key = y_node->z_keys[0];
+	}
+	return BSC_GET_VAL(y_node->z_vals[0]);
+}
+
+void *peek_max(struct cube *cube, bsc_key *key)
+{
+	struct x_node *x_node;
+	bsc_size w, x, y;
+
+	flush_cube(cube);
+
+	if (cube->volume == 0)
+	{
+		return NULL;
+	}
+	w = cube->w_size - 1;
+	x = cube->x_size[w] - 1;
+	y = cube->w_axis[w]->y_size[x] - 1;
+
+	x_node = cube->w_axis[w]->x_axis[x];
+
+	if (key)
+	{
+		*key = x_node->y_axis[y]->z_keys[x_node->z_size[y] - 1];
+	}
+	return BSC_GET_VAL(x_node->y_axis[y]->z_vals[x_node->z_size[y] - 1]);
+}
+
+void *pop_min(struct cube *cube, bsc_key *key)
+{
+	flush_cube(cube);
+
+	if (cube->volume == 0)
+	{
+		return NULL;
+	}
+	if (key)
+	{
+		*key = cube->w_axis[0]->x_axis[0]->y_axis[0]->z_keys[0];
+	}
+	return pop_z_node(cube, 0, 0, 0, 0);
+}
+
+void *pop_max(struct cube *cube, bsc_key *key)
+{
+	bsc_size w, x, y, z;
+
+	flush_cube(cube);
+
+	if (cube->volume == 0)
+	{
+		return NULL;
+	}
+	w = cube->w_size - 1;
+	x = cube->x_size[w] - 1;
+	y = cube->w_axis[w]->y_size[x] - 1;
+	z = cube->w_axis[w]->x_axis[x]->z_size[y] - 1;
+
+	if (key)
+	{
+		*key = cube->w_axis[w]->x_axis[x]->y_axis[y]->z_keys[z];
+	}
+	return pop_z_node(cube, w, x, y, z);
+}
+
+void insert_z_node(struct cube *cube, bsc_size w, bsc_size x, bsc_size y, bsc_size z, bsc_key key, void *val)
+{
+	struct y_node *y_node = BSC_OWN_Y(cube, w, x, y);
+	struct w_node *w_node = cube->w_axis[w];
+	struct x_node *x_node = w_node->x_axis[x];
+
+	BSC_ADD(cube->stamp, 1);
+	BSC_ADD(cube->volume, 1);
+	++cube->w_volume[w];
+	++w_node->x_volume[x];
+
+#if BSC_RANK
+	rank_add(cube, w, x, 1);
+#endif
+
+	++x_node->z_size[y];
+
+	if (z + 1 != x_node->z_size[y])
+	{
+		memmove(&y_node->z_keys[z + 1], &y_node->z_keys[z], (x_node->z_size[y] - z - 1) * sizeof(bsc_key));
+		memmove(&y_node->z_vals[z + 1], &y_node->z_vals[z], (x_node->z_size[y] - z - 1) * sizeof(bsc_val));
+
+		BSC_STAT(cube, moved, (x_node->z_size[y] - z - 1) * (sizeof(bsc_key) + sizeof(bsc_val)));
+	}
+
+	y_node->z_keys[z] = key;
+	BSC_SET_VAL(y_node->z_vals[z], val);
+
+	if (x_node->z_size[y] == BSC_Z_MAX)
+	{
+		split_full_node(cube, w, x, y);
+	}
+	BSC_REFRESH(cube);
+}
+
+// Splits the Z axis at (w, x, y) and any axis above it that reaches m_size as a result. m_size shrinks with the
+// w axis, so an older axis can already be past it and must split before it outgrows its allocation.
+
+void split_full_node(struct cube *cube, bsc_size w, bsc_size x, bsc_size y)
+{
+#if BSC_MVCC
+	own_y_node(cube, w, x, y);
+#endif
+	split_y_node(cube, w, x, y);
+
+	if (cube->w_axis[w]->y_size[x] >= cube->m_size)
+	{
+		split_x_node(cube, w, x);
+
+		if (cube->x_size[w] >= cube->m_size)
+		{
+			split_w_node(cube, w);
+		}
+	}
+}
+
+// Sets *floor to the floor of the Z axis following (w, x, y), returns 0 for the last Z axis.
+
+int next_floor(struct cube *cube, bsc_size w, bsc_size x, bsc_size y, bsc_key *floor)
+{
+	if (y + 1 < cube->w_axis[w]->y_size[x])
+	{
+		*floor = cube->w_axis[w]->x_axis[x]->y_floor[y + 1];
+	}
+	else if (x + 1 < cube->x_size[w])
+	{
+		*floor = cube->w_axis[w]->x_floor[x + 1];
+	}
+	else if (w + 1 < cube->w_size)
+	{
+		*floor = cube->w_floor[w + 1];
+	}
+	else
+	{
+		return 0;
+	}
+	return 1;
+}
+
+// Merges a sorted run that fits into the Z axis at (w, x, y) with a single copy, returns the number of new keys.
+
+int merge_z_node(struct cube *cube, bsc_size w, bsc_size x, bsc_size y, bsc_key *keys, bsc_val *vals, int cnt)
+{
+	struct y_node *y_node = BSC_OWN_Y(cube, w, x, y);
+	struct w_node *w_node = cube->w_axis[w];
+	struct x_node *x_node = w_node->x_axis[x];
+	bsc_key tmp_keys[BSC_Z_MAX];
+	bsc_val tmp_vals[BSC_Z_MAX];
+	int i, j, k, size;
+	bsc_key key;
+	bsc_val val;
+
+	size = x_node->z_size[y];
+
+	for (i = j = k = 0 ; i < size || j < cnt ; k++)
+	{
+		if (i < size && (j == cnt || !BSC_LT(keys[j], y_node->z_keys[i])))
+		{
+			key = y_node->z_keys[i];
+			val = y_node->z_vals[i++];
+		}
+		else
+		{
+			key = keys[j];
+			val = vals[j++];
+		}
+
+		if (k && BSC_EQ(tmp_keys[k - 1], key))
+		{
+			tmp_vals[--k] = val;
+		}
+		else
+		{
+			tmp_keys[k] = key;
+			tmp_vals[k] = val;
+		}
+	}
+
+	memcpy(y_node->z_keys, tmp_keys, k * sizeof(bsc_key));
+	memcpy(y_node->z_vals, tmp_vals, k * sizeof(bsc_val));
+
+	x_node->z_size[y] = k;
+
+	k -= size;
+
+	BSC_ADD(cube->stamp, 1);
+	BSC_ADD(cube->volume, k);
+	cube->w_volume[w] += k;
+	w_node->x_volume[x] += k;
+
+#if BSC_RANK
+	rank_add(cube, w, x, k);
+#endif
+	return k;
+}
+
+// Moves the hint to the Z axis holding key, each axis is only searched when the key left its range.
+// Returns 0 when the key is below the cube's floor.
+
+int search_hint(struct cube *cube, bsc_key key, struct hint *hint)
+{
+	struct w_node *w_node;
+	struct x_node *x_node;
+	bsc_size w, x, y;
+
+	if (cube->w_size == 0 || BSC_LT(key, cube->w_floor[0]))
+	{
+		return 0;
+	}
+
+	w = hint->w < cube->w_size ? hint->w : cube->w_size - 1;
+
+	if (BSC_LT(key, cube->w_floor[w]) || (w + 1 < cube->w_size && !BSC_LT(key, cube->w_floor[w + 1])))
+	{
+		x = BSC_LT(key, cube->w_floor[w]) ? cube->m_size : 0;
+
+		w = search_gallop(cube->w_floor, cube->w_size, w, key);
+	}
+	else
+	{
+		x = hint->x;
+	}
+
+	w_node = cube->w_axis[w];
+
+	x = x < cube->x_size[w] ? x : cube->x_size[w] - 1;
+
+	if (BSC_LT(key, w_node->x_floor[x]) || (x + 1 < cube->x_size[w] && !BSC_LT(key, w_node->x_floor[x + 1])))
+	{
+		y = BSC_LT(key, w_node->x_floor[x]) ? cube->m_size : 0;
+
+		x = search_gallop(w_node->x_floor, cube->x_size[w], x, key);
+	}
+	else
+	{
+		y = w == hint->w && x == hint->x ? hint->y : 0;
+	}
+
+	x_node = w_node->x_axis[x];
+
+	y = y < w_node->y_size[x] ? y : w_node->y_size[x] - 1;
+
+	if (BSC_LT(key, x_node->y_floor[y]) || (y + 1 < w_node->y_size[x] && !BSC_LT(key, x_node->y_floor[y + 1])))
+	{
+		y = search_gallop(x_node->y_floor, w_node->y_size[x], y, key);
+	}
+
+	hint->w = w;
+	hint->x = x;
+	hint->y = y;
+
+	return 1;
+}
+
+void *get_key_hint(struct cube *cube, bsc_key key, struct hint *hint)
+{
+	struct y_node *y_node;
+	bsc_size z;
+
+	flush_cube(cube);
+
+	if (search_hint(cube, key, hint) == 0)
+	{
+		return NULL;
+	}
+
+	y_node = cube->w_axis[hint->w]->x_axis[hint->x]->y_axis[hint->y];
+
+	z = search_z(y_node->z_keys, cube->w_axis[hint->w]->x_axis[hint->x]->z_size[hint->y], key);
+
+	return BSC_EQ(key, y_node->z_keys[z]) ? BSC_GET_VAL(y_node->z_vals[z]) : NULL;
+}
+
+void set_key_hint(struct cube *cube, bsc_key key, void *val, struct hint *hint)
+{
+	struct y_node *y_node;
+	bsc_size z;
+
+	flush_cube(cube);
+
+	if (search_hint(cube, key, hint) == 0)
+	{
+		set_key(cube, key, val);
+
+		return;
+	}
+
+	y_node = cube->w_axis[hint->w]->x_axis[hint->x]->y_axis[hint->y];
+
+	z = search_z(y_node->z_keys, cube->w_axis[hint->w]->x_axis[hint->x]->z_size[hint->y], key);
+
+	if (BSC_EQ(key, y_node->z_keys[z]))
+	{
+		BSC_SET_VAL(BSC_OWN_Y(cube, hint->w, hint->x, hint->y)->z_vals[z], val);
+
+		return;
+	}
+	insert_z_node(cube, hint->w, hint->x, hint->y, z + 1, key, val);
+}
+
+// Inserts n keys sorted in ascending order, a later duplicate replaces an earlier one. The position of the
+// previous run is kept, each Z axis is merged once per run and filled before it is split.
+
+void merge_sorted_keys(struct cube *cube, bsc_key *keys, bsc_val *vals, int n)
+{
+	struct y_node *y_node;
+	bsc_size w = 0, x = 0, y = 0, z;
+	bsc_key floor;
+	int beg, end, room, limit = 0, known = 0;
+
+	for (beg = 0 ; beg < n ; beg = end)
+	{
+		if (cube->w_size == 0 || BSC_LT(keys[beg], cube->w_floor[0]))
+		{
+			set_key(cube, keys[beg], BSC_GET_VAL(vals[beg]));
+
+			end = beg + 1;
+			known = 0;
+
+			continue;
+		}
+
+		// keys ascend, so the axes are only searched from the previous position onward
+
+		if (!known || (w + 1 < cube->w_size && !BSC_LT(keys[beg], cube->w_floor[w + 1])))
+		{
+			w = known ? w + search_wx(&cube->w_floor[w], cube->w_size - w, keys[beg]) : search_wx(cube->w_floor, cube->w_size, keys[beg]);
+			x = search_wx(cube->w_axis[w]->x_floor, cube->x_size[w], keys[beg]);
+			y = search_y(cube->w_axis[w]->x_axis[x]->y_floor, cube->w_axis[w]->y_size[x], keys[beg]);
+		}
+		else if (x + 1 < cube->x_size[w] && !BSC_LT(keys[beg], cube->w_axis[w]->x_floor[x + 1]))
+		{
+			x += search_wx(&cube->w_axis[w]->x_floor[x], cube->x_size[w] - x, keys[beg]);
+			y = search_y(cube->w_axis[w]->x_axis[x]->y_floor, cube->w_axis[w]->y_size[x], keys[beg]);
+		}
+		else if (y + 1 < cube->w_axis[w]->y_size[x] && !BSC_LT(keys[beg], cube->w_axis[w]->x_axis[x]->y_floor[y + 1]))
+		{
+			y = search_y(cube->w_axis[w]->x_axis[x]->y_floor, cube->w_axis[w]->y_size[x], keys[beg]);
+		}
+		limit = next_floor(cube, w, x, y, &floor);
+
+		known = 1;
+
+		room = BSC_Z_MAX - 1 - cube->w_axis[w]->x_axis[x]->z_size[y];
+
+		if (room == 0)
+		{
+			split_full_node(cube, w, x, y);
+
+			end = beg;
+			known = 0;
+
+			continue;
+		}
+
+		for (end = beg + 1 ; end < n && end - beg < room ; end++)
+		{
+			if (limit && !BSC_LT(keys[end], floor))
+			{
+				break;
+			}
+		}
+
+		if (end - beg > 1)
+		{
+			merge_z_node(cube, w, x, y, &keys[beg], &vals[beg], end - beg);
+
+			continue;
+		}
+
+		// a lone key is cheaper to insert in place
+
+		y_node = cube->w_axis[w]->x_axis[x]->y_axis[y];
+
+		z = search_z(y_node->z_keys, cube->w_axis[w]->x_axis[x]->z_size[y], keys[beg]);
+
+		if (BSC_EQ(keys[beg], y_node->z_keys[z]))
+		{
+			BSC_OWN_Y(cube, w, x, y)->z_vals[z] = vals[beg];
+		}
+		else
+		{
+			insert_z_node(cube, w, x, y, z + 1, keys[beg], BSC_GET_VAL(vals[beg]));
+		}
+	}
+	BSC_REFRESH(cube);
+}
+
+// Stable insertion sort of key/value pairs, used for Z axes and insert buffers that were filled out of order.
+
+void sort_pairs(bsc_key *keys, bsc_val *vals, int size)
+{
+	bsc_key key;
+	bsc_val val;
+	int cnt, z;
+
+	for (cnt = 1 ; cnt < size ; cnt++)
+	{
+		key = keys[cnt];
+
+		if (!BSC_LT(key, keys[cnt - 1]))
+		{
+			continue;
+		}
+		val = vals[cnt];
+
+		for (z = cnt ; z && BSC_LT(key, keys[z - 1]) ; z--)
+		{
+			keys[z] = keys[z - 1];
+			vals[z] = vals[z - 1];
+		}
+		keys[z] = key;
+		vals[z] = val;
+	}
+}
+
+void sort_z_node(struct cube *cube, bsc_size w, bsc_size x, bsc_size y)
+{
+	struct x_node *x_node = cube->w_axis[w]->x_axis[x];
+
+	sort_pairs(x_node->y_axis[y]->z_keys, x_node->y_axis[y]->z_vals, x_node->z_size[y]);
+}
+
+void set_key_sorted_batch(struct cube *cube, bsc_key *keys, bsc_val *vals, int n)
+{
+	flush_cube(cube);
+
+	merge_sorted_keys(cube, keys, vals, n);
+}
+
+#if BSC_BUFFER
+
+// Sorts the unsorted tail of the buffer and merges it into the sorted part, a newer key ends up after an older equal key.
+
+void sort_buffer(struct w_node *w_node)
+{
+	bsc_key keys[BSC_BUFFER_TAIL];
+	bsc_val vals[BSC_BUFFER_TAIL];
+	int i, j, k, tail;
+
+	tail = w_node->buf_size - w_node->buf_sort;
+
+	memcpy(keys, &w_node->buf_keys[w_node->buf_sort], tail * sizeof(bsc_key));
+	memcpy(vals, &w_node->buf_vals[w_node->buf_sort], tail * sizeof(bsc_val));
+
+	sort_pairs(keys, vals, tail);
+
+	i = w_node->buf_sort - 1;
+	j = tail - 1;
+
+	for (k = w_node->buf_size - 1 ; j >= 0 ; k--)
+	{
+		if (i >= 0 && BSC_LT(keys[j], w_node->buf_keys[i]))
+		{
+			w_node->buf_keys[k] = w_node->buf_keys[i];
+			w_node->buf_vals[k] = w_node->buf_vals[i--];
+		}
+		else
+		{
+			w_node->buf_keys[k] = keys[j];
+			w_node->buf_vals[k] = vals[j--];
+		}
+	}
+	w_node->buf_sort = w_node->buf_size;
+}
+
+void buffer_key(struct cube *cube, bsc_size w, bsc_key key, void *val)
+{
+	struct w_node *w_node = cube->w_axis[w];
+
+	if (w_node->buf_keys == NULL)
+	{
+		w_node->buf_keys = (bsc_key *) bsc_alloc(cube, BSC_BUFFER * sizeof(bsc_key));
+		w_node->buf_vals = (bsc_val *) bsc_alloc(cube, BSC_BUFFER * sizeof(bsc_val));
+	}
+
+	w_node->buf_keys[w_node->buf_size] = key;
+	BSC_SET_VAL(w_node->buf_vals[w_node->buf_size], val);
+
+	w_node->buf_size++;
+	cube->buffered++;
+
+	if (w_node->buf_size - w_node->buf_sort == BSC_BUFFER_TAIL)
+	{
+		sort_buffer(w_node);
+	}
+
+	if (w_node->buf_size == BSC_BUFFER)
+	{
+		flush_buffer(cube, w);
+	}
+}
+#endif
+
+// The buffer is detached while its keys are merged, so a split of the w_node during the merge finds it empty.
+
+void flush_buffer(struct cube *cube, bsc_size w)
+{
+#if BSC_BUFFER
+	struct w_node *w_node = cube->w_axis[w];
+	bsc_key *keys = w_node->buf_keys;
+	bsc_val *vals = w_node->buf_vals;
+	int size = w_node->buf_size;
+
+	if (size == 0)
+	{
+		return;
+	}
+
+	if (w_node->buf_sort != size)
+	{
+		sort_buffer(w_node);
+	}
+
+	w_node->buf_keys = NULL;
+	w_node->buf_vals = NULL;
+	w_node->buf_size = w_node->buf_sort = 0;
+
+	cube->buffered -= size;
+
+	merge_sorted_keys(cube, keys, vals, size);
+
+	w_node->buf_keys = keys;
+	w_node->buf_vals = vals;
+#endif
+}
+
+void flush_cube(struct cube *cube)
+{
+#if BSC_BUFFER
+	bsc_size w;
+
+	for (w = 0 ; cube->buffered && w < cube->w_size ; w++)
+	{
+		flush_buffer(cube, w);
+	}
+#endif
+}
+
+// Cubesort, keys are appended unsorted to the Z axis their floors select, and a Z axis is only sorted when it
+// fills up and must be split, or when the cube is flushed back to the array. Equal keys keep their order.
+
+void cubesort_kv(bsc_key *keys, bsc_val *vals, size_t n)
+{
+	struct cube *cube;
+	struct w_node *w_node;
+	struct x_node *x_node;
+	bsc_size w, x, y, z;
+	size_t cnt;
+
+	if (n < 2)
+	{
+		return;
+	}
+	cube = create_cube();
+
+	set_key(cube, keys[0], vals ? BSC_GET_VAL(vals[0]) : NULL);
+
+	for (cnt = 1 ; cnt < n ; cnt++)
+	{
+		if (BSC_LT(keys[cnt], cube->w_floor[0]))
+		{
+			w = x = y = 0;
+
+			cube->w_floor[0] = cube->w_axis[0]->x_floor[0] = cube->w_axis[0]->x_axis[0]->y_floor[0] = keys[cnt];
+
+			BSC_STALE_W(cube);
+			BSC_STALE_X(cube, cube->w_axis[0]);
+		}
+		else
+		{
+			w = search_wx(cube->w_floor, cube->w_size, keys[cnt]);
+			x = search_wx(cube->w_axis[w]->x_floor, cube->x_size[w], keys[cnt]);
+			y = search_y(cube->w_axis[w]->x_axis[x]->y_floor, cube->w_axis[w]->y_size[x], keys[cnt]);
+		}
+		w_node = cube->w_axis[w];
+		x_node = w_node->x_axis[x];
+
+		z = x_node->z_size[y];
+
+		if (z == BSC_Z_MAX - 1)
+		{
+			sort_z_node(cube, w, x, y);
+
+			z = !BSC_LT(keys[cnt], x_node->y_axis[y]->z_keys[0]) ? search_z(x_node->y_axis[y]->z_keys, z, keys[cnt]) + 1 : 0;
+		}
+		insert_z_node(cube, w, x, y, z, keys[cnt], vals ? BSC_GET_VAL(vals[cnt]) : NULL);
+	}
+
+	for (w = 0 ; w < cube->w_size ; w++)
+	{
+		for (x = 0 ; x < cube->x_size[w] ; x++)
+		{
+			for (y = 0 ; y < cube->w_axis[w]->y_size[x] ; y++)
+			{
+				sort_z_node(cube, w, x, y);
+			}
+		}
+	}
+	cube_to_array(cube, keys, vals);
+
+	destroy_cube(cube);
+}
+
+void cubesort(bsc_key *array, size_t n)
+{
+	cubesort_kv(array, NULL, n);
+}
+
+#if BSC_STATS
+
+// The number of steps a binary search takes on an axis of the given size.
+
+int search_depth(unsigned int size)
+{
+	int depth = 0;
+
+	while (size)
+	{
+		depth++;
+		size >>= 1;
+	}
+	return depth;
+}
+#endif
+
+inline void *find_key(struct cube *cube, bsc_key key, bsc_size *w_index, bsc_size *x_index, bsc_size *y_index, bsc_size *z_index)
+{
+	struct w_node *w_node;
+	struct x_node *x_node;
+	struct y_node *y_node;
+
+	bsc_size w, x, y, z;
+
+	if (cube->w_size == 0 || BSC_LT(key, cube->w_floor[0]))
+	{
+		*w_index = *x_index = *y_index = *z_index = 0;
+
+		return NULL;
+	}
+
+	// w
+
+	w = BSC_SEARCH_W(cube, key);
+
+	w_node = cube->w_axis[w];
+
+	// x
+
+	x = BSC_SEARCH_X(cube, w, key);
+
+	x_node = w_node->x_axis[x];
+
+	// y
+
+	y = search_y(x_node->y_floor, w_node->y_size[x], key);
+
+	y_node = x_node->y_axis[y];
+
+	// z
+
+	z = search_z(y_node->z_keys, x_node->z_size[y], key);
+
+#if BSC_STATS
+	BSC_STAT(cube, lookups, 1);
+	BSC_STAT(cube, lookup_depth, search_depth(cube->w_size) + search_depth(cube->x_size[w]) + search_depth(w_node->y_size[x]) + search_depth(x_node->z_size[y]));
+#endif
+	*w_index = w;
+	*x_index = x;
+	*y_index = y;
+
+	if (BSC_EQ(key, y_node->z_keys[z]))
+	{
+		*z_index = z;
+
+		return BSC_GET_VAL(y_node->z_vals[z]);
+	}
+
+	*z_index = z + 1;
+
+	return NULL;
+}
+
+inline void *find_index(struct cube *cube, bsc_vol index, bsc_size *w_index, bsc_size *x_index, bsc_size *y_index, bsc_size *z_index)
+{
+	struct w_node *w_node;
+	struct x_node *x_node;
+	struct y_node *y_node;
+	register bsc_size w, x, y;
+#if !BSC_RANK
+	bsc_vol total;
+#endif
+
+	if (index < 0 || index >= cube->volume)
+	{
+		return NULL;
+	}
+
+#if BSC_RANK
+	w = find_tree(rank_w_tree(cube), cube->w_size, &index);
+	x = find_tree(rank_x_tree(cube, w), cube->x_size[w], &index);
+
+	w_node = cube->w_axis[w];
+	x_node = w_node->x_axis[x];
+
+	if (index < w_node->x_volume[x] / 2)
+	{
+		for (y = 0 ; index >= x_node->z_size[y] ; y++)
+		{
+			index -= x_node->z_size[y];
+		}
+	}
+	else
+	{
+		index -= w_node->x_volume[x];
+
+		for (y = w_node->y_size[x] - 1 ; index + x_node->z_size[y] < 0 ; y--)
+		{
+			index += x_node->z_size[y];
+		}
+		index += x_node->z_size[y];
+	}
+	y_node = x_node->y_axis[y];
+
+	*w_index = w;
+	*x_index = x;
+	*y_index = y;
+	*z_index = index;
+
+	return BSC_GET_VAL(y_node->z_vals[index]);
+#else
+	if (index < cube->volume / 2)
+	{
+		total = 0;
+
+		for (w = 0 ; w < cube->w_size ; w++)
+		{
+			w_node = cube->w_axis[w];
+
+			if (total + cube->w_volume[w] > index)
+			{
+				if (index > total + cube->w_volume[w] / 2)
+				{
+					total += cube->w_volume[w];
+
+					goto backward_x;
+				}
+				forward_x:
+
+				for (x = 0 ; x < cube->x_size[w] ; x++)
+				{
+					x_node = w_node->x_axis[x];
+
+					if (total + w_node->x_volume[x] > index)
+					{
+						if (index > total + w_node->x_volume[x] / 2)
+						{
+							total += w_node->x_volume[x];
+
+							goto backward_y;
+						}
+						forward_y:
+
+						for (y = 0 ; y < w_node->y_size[x] ; y++)
+						{
+							y_node = x_node->y_axis[y];
+
+							if (total + x_node->z_size[y] > index)
+							{
+								*w_index = w;
+								*x_index = x;
+								*y_index = y;
+								*z_index = index - total;
+
+								return BSC_GET_VAL(y_node->z_vals[index - total]);
+							}
+							total += x_node->z_size[y];
+						}
+					}
+					total += w_node->x_volume[x];
+				}
+			}
+			total += cube->w_volume[w];
+		}
+	}
+	else
+	{
+		total = cube->volume;
+
+		for (w = cube->w_size - 1 ; w >= 0 ; w--)
+		{
+			w_node = cube->w_axis[w];
+
+			if (total - cube->w_volume[w] <= index)
+			{
+				if (index < total - cube->w_volume[w] / 2)
+				{
+					total -= cube->w_volume[w];
+
+					goto forward_x;
+				}
+				backward_x:
+
+				for (x = cube->x_size[w] - 1 ; x >= 0 ; x--)
+				{
+					x_node = w_node->x_axis[x];
+
+					if (total - w_node->x_volume[x] <= index)
+					{
+						if (index < total - w_node->x_volume[x] / 2)
+						{
+							total -= w_node->x_volume[x];
+
+							goto forward_y;
+						}
+						backward_y:
+
+						for (y = w_node->y_size[x] - 1 ; y >= 0 ; y--)
+						{
+							y_node = x_node->y_axis[y];
+
+							if (total - x_node->z_size[y] <= index)
+							{
+								*w_index = w;
+								*x_index = x;
+								*y_index = y;
+								*z_index = x_node->z_size[y] - (total - index);
+
+								return BSC_GET_VAL(y_node->z_vals[x_node->z_size[y] - (total - index)]);
+							}
+							total -= x_node->z_size[y];
+						}
+					}
+					total -= w_node->x_volume[x];
+				}
+			}
+			total -= cube->w_volume[w];
+		}
+	}
+	return NULL;
+#endif
+}
+
+// An axis is trimmed once it uses less than a quarter of its allocation. It keeps room for twice its size, so it
+// is not trimmed again before it has doubled, regrown to m_size and lost three quarters once more.
+
+bsc_size trim_size(bsc_size size, bsc_size max)
+{
+	bsc_size trim = (size * 2 / BSC_M + 1) * BSC_M;
+
+	return size < max / 4 && trim < max ? trim : 0;
+}
+
+void trim_cube_axis(struct cube *cube)
+{
+	if (cube->w_max < cube->m_size * 2)
+	{
+		return;
+	}
+	resize_cube(cube, cube->m_size);
+
+#if BSC_RANK
+	if (cube->w_tree)
+	{
+		bsc_free(cube, cube->w_tree, cube->w_tree_max * sizeof(bsc_vol));
+
+		cube->w_tree = NULL;
+		cube->w_tree_max = 0;
+	}
+	cube->w_ranked = 0;
+#endif
+}
+
+void trim_w_node(struct cube *cube, bsc_size w)
+{
+	struct w_node *w_node;
+	bsc_size size = trim_size(cube->x_size[w], cube->w_axis[w]->x_max);
+
+	if (size == 0)
+	{
+		return;
+	}
+	w_node = BSC_OWN_W(cube, w);
+
+	resize_w_node(cube, w_node, size);
+
+#if BSC_RANK
+	if (w_node->x_tree)
+	{
+		bsc_free(cube, w_node->x_tree, w_node->x_tree_max * sizeof(bsc_vol));
+
+		w_node->x_tree = NULL;
+		w_node->x_tree_max = 0;
+	}
+	w_node->x_ranked = 0;
+#endif
+}
+
+void trim_x_node(struct cube *cube, bsc_size w, bsc_size x)
+{
+	bsc_size size = trim_size(cube->w_axis[w]->y_size[x], cube->w_axis[w]->x_axis[x]->y_max);
+
+	if (size == 0)
+	{
+		return;
+	}
+	resize_x_node(cube, BSC_OWN_X(cube, w, x), size);
+}
+
+// Deletes trim the axes they shrink, this pass catches the axes that were left oversized when m_size went down.
+// remove_w_node already keeps the w axis below twice m_size, so only the w_nodes and x_nodes are visited. Each
+// call trims at most budget axes and resumes where the last call stopped, it returns 1 when a pass over the cube
+// is complete, after which empty slabs are released as well. With BSC_MT it needs the exclusive cube lock.
+
+int shrink_cube(struct cube *cube, int budget)
+{
+	while (budget-- > 0)
+	{
+		if (cube->trim_w >= cube->w_size)
+		{
+			cube->trim_w = cube->trim_x = 0;
+
+#if BSC_POOL
+			trim_pool(&cube->pool);
+#endif
+			return 1;
+		}
+
+		if (cube->trim_x >= cube->x_size[cube->trim_w])
+		{
+			trim_w_node(cube, cube->trim_w);
+
+			cube->trim_w++;
+			cube->trim_x = 0;
+		}
+		else
+		{
+			trim_x_node(cube, cube->trim_w, cube->trim_x++);
+		}
+	}
+	return 0;
+}
+
+inline void insert_w_node(struct cube *cube, bsc_size w)
+{
+#if BSC_RANK
+	cube->w_ranked = 0;
+#endif
+	BSC_STALE_W(cube);
+
+	++cube->w_size;
+
+	if (cube->w_size == cube->m_size)
+	{
+		cube->m_size += BSC_M;
+
+		resize_cube(cube, cube->m_size);
+	}
+
+	if (w + 1 != cube->w_size)
+	{
+		memmove(&cube->w_floor[w + 1], &cube->w_floor[w], (cube->w_size - w - 1) * sizeof(bsc_key));
+		memmove(&cube->w_axis[w + 1], &cube->w_axis[w], (cube->w_size - w - 1) * sizeof(struct w_node *));
+		memmove(&cube->w_volume[w + 1], &cube->w_volume[w], (cube->w_size - w - 1) * sizeof(bsc_vol));
+		memmove(&cube->x_size[w + 1], &cube->x_size[w], (cube->w_size - w - 1) * sizeof(bsc_size));
+
+		BSC_STAT(cube, moved, (cube->w_size - w - 1) * (sizeof(bsc_key) + sizeof(struct w_node *) + sizeof(bsc_vol) + sizeof(bsc_size)));
+	}
+
+	cube->w_axis[w] = create_w_node(cube, cube->m_size);
+}
+
+void remove_w_node(struct cube *cube, bsc_size w)
+{
+#if BSC_RANK
+	cube->w_ranked = 0;
+#endif
+	BSC_STALE_W(cube);
+
+	cube->w_size--;
+
+	free_w_node(cube, cube->w_axis[w]);
+
+	if (cube->w_size < cube->m_size - BSC_M)
+	{
+		cube->m_size -= BSC_M;
+	}
+
+	if (cube->w_size)
+	{
+		if (cube->w_size != w)
+		{
+			memmove(&cube->w_floor[w], &cube->w_floor[w + 1], (cube->w_size - w) * sizeof(bsc_key));
+			memmove(&cube->w_axis[w], &cube->w_axis[w + 1], (cube->w_size - w) * sizeof(struct w_node *));
+			memmove(&cube->w_volume[w], &cube->w_volume[w + 1], (cube->w_size - w) * sizeof(bsc_vol));
+			memmove(&cube->x_size[w], &cube->x_size[w + 1], (cube->w_size - w) * sizeof(bsc_size));
+
+			BSC_STAT(cube, moved, (cube->w_size - w) * (sizeof(bsc_key) + sizeof(struct w_node *) + sizeof(bsc_vol) + sizeof(bsc_size)));
+		}
+		trim_cube_axis(cube);
+	}
+	else
+	{
+		free_cube_axis(cube);
+	}
+}
+
+inline void insert_x_node(struct cube *cube, bsc_size w, bsc_size x)
+{
+	struct w_node *w_node = cube->w_axis[w];
+
+	bsc_size x_size = ++cube->x_size[w];
+
+#if BSC_RANK
+	w_node->x_ranked = 0;
+#endif
+	BSC_STALE_X(cube, w_node);
+
+	if (x_size % BSC_M == 0 && x_size < cube->m_size)
+	{
+		resize_w_node(cube, w_node, cube->m_size);
+	}
+
+	if (x_size != x + 1)
+	{
+		memmove(&w_node->x_floor[x + 1], &w_node->x_floor[x], (x_size - x - 1) * sizeof(bsc_key));
+		memmove(&w_node->x_axis[x + 1], &w_node->x_axis[x], (x_size - x - 1) * sizeof(struct x_node *));
+		memmove(&w_node->x_volume[x + 1], &w_node->x_volume[x], (x_size - x - 1) * sizeof(bsc_xvol));
+		memmove(&w_node->y_size[x + 1], &w_node->y_size[x], (x_size - x - 1) * sizeof(bsc_size));
+
+		BSC_STAT(cube, moved, (x_size - x - 1) * (sizeof(bsc_key) + sizeof(struct x_node *) + sizeof(bsc_xvol) + sizeof(bsc_size)));
+	}
+
+	w_node->x_axis[x] = create_x_node(cube, cube->m_size);
+}
+
+void remove_x_node(struct cube *cube, bsc_size w, bsc_size x)
+{
+	struct w_node *w_node = cube->w_axis[w];
+
+#if BSC_RANK
+	w_node->x_ranked = 0;
+#endif
+	BSC_STALE_X(cube, w_node);
+
+	cube->x_size[w]--;
+
+	free_x_node(cube, w_node->x_axis[x]);
+
+	if (cube->x_size[w])
+	{
+		if (cube->x_size[w] != x)
+		{
+			memmove(&w_node->x_floor[x], &w_node->x_floor[x + 1], (cube->x_size[w] - x ) * sizeof(bsc_key));
+			memmove(&w_node->x_axis[x], &w_node->x_axis[x + 1], (cube->x_size[w] - x ) * sizeof(struct x_node *));
+			memmove(&w_node->x_volume[x], &w_node->x_volume[x + 1], (cube->x_size[w] - x ) * sizeof(bsc_xvol));
+			memmove(&w_node->y_size[x], &w_node->y_size[x + 1], (cube->x_size[w] - x ) * sizeof(bsc_size));
+
+			BSC_STAT(cube, moved, (cube->x_size[w] - x) * (sizeof(bsc_key) + sizeof(struct x_node *) + sizeof(bsc_xvol) + sizeof(bsc_size)));
+		}
+
+		if (x == 0)
+		{
+			cube->w_floor[w] = w_node->x_floor[0];
+
+			BSC_STALE_W(cube);
+		}
+		trim_w_node(cube, w);
+	}
+	else
+	{
+		remove_w_node(cube, w);
+	}
+}
+
+inline void insert_y_node(struct cube *cube, bsc_size w, bsc_size x, bsc_size y)
+{
+	struct x_node *x_node = cube->w_axis[w]->x_axis[x];
+
+	bsc_size y_size = ++cube->w_axis[w]->y_size[x];
+
+	if (y_size % BSC_M == 0 && y_size < cube->m_size)
+	{
+		resize_x_node(cube, x_node, cube->m_size);
+	}
+
+	if (y_size != y + 1)
+	{
+		memmove(&x_node->y_floor[y + 1], &x_node->y_floor[y], (y_size - y - 1) * sizeof(bsc_key));
+		memmove(&x_node->y_axis[y + 1], &x_node->y_axis[y], (y_size - y - 1) * sizeof(struct y_node *));
+		memmove(&x_node->z_size[y + 1], &x_node->z_size[y], (y_size - y - 1) * sizeof(unsigned char));
+
+		BSC_STAT(cube, moved, (y_size - y - 1) * (sizeof(bsc_key) + sizeof(struct y_node *) + sizeof(unsigned char)));
+	}
+
+	x_node->y_axis[y] = create_y_node(cube);
+}
+
+void remove_y_node(struct cube *cube, bsc_size w, bsc_size x, bsc_size y)
+{
+	struct w_node *w_node = cube->w_axis[w];
+	struct x_node *x_node = w_node->x_axis[x];
+
+	w_node->y_size[x]--;
+
+	free_y_node(cube, x_node->y_axis[y]);
+
+	if (w_node->y_size[x])
+	{
+		if (w_node->y_size[x] != y)
+		{
+			memmove(&x_node->y_floor[y], &x_node->y_floor[y + 1], (w_node->y_size[x] - y ) * sizeof(bsc_key));
+			memmove(&x_node->y_axis[y], &x_node->y_axis[y + 1], (w_node->y_size[x] - y ) * sizeof(struct y_node *));
+			memmove(&x_node->z_size[y], &x_node->z_size[y + 1], (w_node->y_size[x] - y ) * sizeof(unsigned char));
+
+			BSC_STAT(cube, moved, (w_node->y_size[x] - y) * (sizeof(bsc_key) + sizeof(struct y_node *) + sizeof(unsigned char)));
+		}
+
+		if (y == 0)
+		{
+			cube->w_axis[w]->x_floor[x] = x_node->y_floor[0];
+
+			BSC_STALE_X(cube, cube->w_axis[w]);
+
+			if (x == 0)
+			{
+				cube->w_floor[w] = x_node->y_floor[0];
+
+				BSC_STALE_W(cube);
+			}
+		}
+		trim_x_node(cube, w, x);
+	}
+	else
+	{
+		remove_x_node(cube, w, x);
+	}
+}
+
+inline void *remove_z_node(struct cube *cube, bsc_size w, bsc_size x, bsc_size y, bsc_size z)
+{
+	struct y_node *y_node = BSC_OWN_Y(cube, w, x, y);
+	struct w_node *w_node = cube->w_axis[w];
+	struct x_node *x_node = w_node->x_axis[x];
+	void *val;
+
+	BSC_ADD(cube->stamp, 1);
+	BSC_ADD(cube->volume, -1);
+
+	cube->w_volume[w]--;
+	w_node->x_volume[x]--;
+
+#if BSC_RANK
+	rank_add(cube, w, x, -1);
+#endif
+
+	x_node->z_size[y]--;
+
+#if BSC_VAL_SIZE
+	cube->removed = y_node->z_vals[z];
+	val = &cube->removed;
+#else
+	val = y_node->z_vals[z];
+#endif
+
+	if (x_node->z_size[y] != z)
+	{
+		memmove(&y_node->z_keys[z], &y_node->z_keys[z + 1], (x_node->z_size[y] - z) * sizeof(bsc_key));
+		memmove(&y_node->z_vals[z], &y_node->z_vals[z + 1], (x_node->z_size[y] - z) * sizeof(bsc_val));
+
+		BSC_STAT(cube, moved, (x_node->z_size[y] - z) * (sizeof(bsc_key) + sizeof(bsc_val)));
+	}
+
+	if (x_node->z_size[y])
+	{
+		if (z == 0)
+		{
+			x_node->y_floor[y] = y_node->z_keys[z];
+
+			if (y == 0)
+			{
+				w_node->x_floor[x] = y_node->z_keys[z];
+
+				BSC_STALE_X(cube, w_node);
+
+				if (x == 0)
+				{
+					cube->w_floor[w] = y_node->z_keys[z];
+
+					BSC_STALE_W(cube);
+				}
+			}
+		}
+
+		if (y && x_node->z_size[y] < BSC_Z_MIN && x_node->z_size[y - 1] < BSC_Z_MIN)
+		{
+			merge_y_node(cube, w, x, y - 1, y);
+
+			if (x && w_node->y_size[x] < cube->m_size / 4 && w_node->y_size[x - 1] < cube->m_size / 4)
+			{
+				merge_x_node(cube, w, x - 1, x);
+
+				if (w && cube->x_size[w] < cube->m_size / 4 && cube->x_size[w - 1] < cube->m_size / 4)
+				{
+					merge_w_node(cube, w - 1, w);
+				}
+			}
+		}
+	}
+	else
+	{
+		remove_y_node(cube, w, x, y);
+	}
+	BSC_REFRESH(cube);
+
+	return val;
+}
+
+// Removes the first or last key of the cube, an end Z axis is removed once empty so no merge checks are needed.
+
+void *pop_z_node(struct cube *cube, bsc_size w, bsc_size x, bsc_size y, bsc_size z)
+{
+	struct y_node *y_node = BSC_OWN_Y(cube, w, x, y);
+	struct w_node *w_node = cube->w_axis[w];
+	struct x_node *x_node = w_node->x_axis[x];
+	void *val;
+
+	BSC_ADD(cube->stamp, 1);
+	BSC_ADD(cube->volume, -1);
+
+	cube->w_volume[w]--;
+	w_node->x_volume[x]--;
+
+#if BSC_RANK
+	rank_add(cube, w, x, -1);
+#endif
+
+	x_node->z_size[y]--;
+
+#if BSC_VAL_SIZE
+	cube->removed = y_node->z_vals[z];
+	val = &cube->removed;
+#else
+	val = y_node->z_vals[z];
+#endif
+
+	if (x_node->z_size[y] == 0)
+	{
+		remove_y_node(cube, w, x, y);
+	}
+	else if (z == 0)
+	{
+		memmove(&y_node->z_keys[0], &y_node->z_keys[1], x_node->z_size[y] * sizeof(bsc_key));
+		memmove(&y_node->z_vals[0], &y_node->z_vals[1], x_node->z_size[y] * sizeof(bsc_val));
+
+		BSC_STAT(cube, moved, x_node->z_size[y] * (sizeof(bsc_key) + sizeof(bsc_val)));
+
+		x_node->y_floor[0] = w_node->x_floor[0] = cube->w_floor[0] = y_node->z_keys[0];
+
+		BSC_STALE_W(cube);
+		BSC_STALE_X(cube, w_node);
+	}
+	BSC_REFRESH(cube);
+
+	return val;
+}
+
+// With BSC_BUFFER the buffer of the w_node must be empty.
+
+void split_w_node(struct cube *cube, bsc_size w)
+{
+	struct w_node *w_node1, *w_node2;
+	bsc_size x;
+	bsc_vol volume;
+
+	BSC_STAT(cube, w_splits, 1);
+
+	insert_w_node(cube, w + 1);
+
+	w_node1 = cube->w_axis[w];
+	w_node2 = cube->w_axis[w + 1];
+
+#if BSC_RANK
+	w_node1->x_ranked = 0;
+#endif
+	BSC_STALE_X(cube, w_node1);
+
+	cube->x_size[w + 1] = cube->x_size[w] / 2;
+	cube->x_size[w] -= cube->x_size[w + 1];
+
+	memcpy(&w_node2->x_floor[0], &w_node1->x_floor[cube->x_size[w]], cube->x_size[w + 1] * sizeof(bsc_key));
+	memcpy(&w_node2->x_axis[0], &w_node1->x_axis[cube->x_size[w]], cube->x_size[w + 1] * sizeof(struct x_node *));
+	memcpy(&w_node2->x_volume[0], &w_node1->x_volume[cube->x_size[w]], cube->x_size[w + 1] * sizeof(bsc_xvol));
+	memcpy(&w_node2->y_size[0], &w_node1->y_size[cube->x_size[w]], cube->x_size[w + 1] * sizeof(bsc_size));
+
+	for (x = volume = 0 ; x < cube->x_size[w] ; x++)
+	{
+		volume += w_node1->x_volume[x];
+	}
+
+	cube->w_volume[w + 1] = cube->w_volume[w] - volume;
+	cube->w_volume[w] = volume;
+
+	cube->w_floor[w + 1] = w_node2->x_floor[0];
+}
+
+void merge_w_node(struct cube *cube, bsc_size w1, bsc_size w2)
+{
+	struct w_node *w_node1 = BSC_OWN_W(cube, w1);
+	struct w_node *w_node2 = cube->w_axis[w2];
+
+	BSC_STAT(cube, w_merges, 1);
+
+#if BSC_RANK
+	w_node1->x_ranked = 0;
+#endif
+	BSC_STALE_X(cube, w_node1);
+
+	resize_w_node(cube, w_node1, cube->m_size);
+
+	memcpy(&w_node1->x_floor[cube->x_size[w1]], &w_node2->x_floor[0], cube->x_size[w2] * sizeof(bsc_key));
+	memcpy(&w_node1->x_axis[cube->x_size[w1]], &w_node2->x_axis[0], cube->x_size[w2] * sizeof(struct x_node *));
+	memcpy(&w_node1->x_volume[cube->x_size[w1]], &w_node2->x_volume[0], cube->x_size[w2] * sizeof(bsc_xvol));
+	memcpy(&w_node1->y_size[cube->x_size[w1]], &w_node2->y_size[0], cube->x_size[w2] * sizeof(bsc_size));
+
+	cube->x_size[w1] += cube->x_size[w2];
+
+	cube->w_volume[w1] += cube->w_volume[w2];
+
+	remove_w_node(cube, w2);
+}
+
+void split_x_node(struct cube *cube, bsc_size w, bsc_size x)
+{
+	struct w_node *w_node;
+	struct x_node *x_node1, *x_node2;
+	bsc_size y;
+	int volume;
+
+	BSC_STAT(cube, x_splits, 1);
+
+	insert_x_node(cube, w, x + 1);
+
+	w_node = cube->w_axis[w];
+
+	x_node1 = w_node->x_axis[x];
+	x_node2 = w_node->x_axis[x + 1];
+
+	w_node->y_size[x + 1] = w_node->y_size[x] / 2;
+	w_node->y_size[x] -= w_node->y_size[x + 1];
+
+	memcpy(&x_node2->y_floor[0], &x_node1->y_floor[w_node->y_size[x]], w_node->y_size[x + 1] * sizeof(bsc_key));
+	memcpy(&x_node2->y_axis[0], &x_node1->y_axis[w_node->y_size[x]], w_node->y_size[x + 1] * sizeof(struct y_node *));
+	memcpy(&x_node2->z_size[0], &x_node1->z_size[w_node->y_size[x]], w_node->y_size[x + 1] * sizeof(unsigned char));
+
+	for (y = volume = 0 ; y < w_node->y_size[x] ; y++)
+	{
+		volume += x_node1->z_size[y];
+	}
+
+	w_node->x_volume[x + 1] = w_node->x_volume[x] - volume;
+	w_node->x_volume[x] = volume;
+
+	cube->w_axis[w]->x_floor[x + 1] = x_node2->y_floor[0];
+}
+
+void merge_x_node(struct cube *cube, bsc_size w, bsc_size x1, bsc_size x2)
+{
+	struct x_node *x_node1 = BSC_OWN_X(cube, w, x1);
+	struct w_node *w_node = cube->w_axis[w];
+	struct x_node *x_node2 = w_node->x_axis[x2];
+
+	BSC_STAT(cube, x_merges, 1);
+
+	resize_x_node(cube, x_node1, cube->m_size);
+
+	memcpy(&x_node1->y_floor[w_node->y_size[x1]], &x_node2->y_floor[0], w_node->y_size[x2] * sizeof(bsc_key));
+	memcpy(&x_node1->y_axis[w_node->y_size[x1]], &x_node2->y_axis[0], w_node->y_size[x2] * sizeof(struct y_node *));
+	memcpy(&x_node1->z_size[w_node->y_size[x1]], &x_node2->z_size[0], w_node->y_size[x2] * sizeof(unsigned char));
+
+	w_node->y_size[x1] += w_node->y_size[x2];
+
+	w_node->x_volume[x1] += w_node->x_volume[x2];
+
+	remove_x_node(cube, w, x2);
+}
+
+
+void split_y_node(struct cube *cube, bsc_size w, bsc_size x, bsc_size y)
+{
+	struct x_node *x_node;
+	struct y_node *y_node1, *y_node2;
+
+	BSC_STAT(cube, y_splits, 1);
+
+	insert_y_node(cube, w, x, y + 1);
+
+	x_node = cube->w_axis[w]->x_axis[x];
+
+	y_node1 = x_node->y_axis[y];
+	y_node2 = x_node->y_axis[y + 1];
+
+	x_node->z_size[y + 1] = x_node->z_size[y] / 2;
+	x_node->z_size[y] -= x_node->z_size[y + 1];
+
+	memcpy(&y_node2->z_keys[0], &y_node1->z_keys[x_node->z_size[y]], x_node->z_size[y + 1] * sizeof(bsc_key));
+	memcpy(&y_node2->z_vals[0], &y_node1->z_vals[x_node->z_size[y]], x_node->z_size[y + 1] * sizeof(bsc_val));
+
+	x_node->y_floor[y + 1] = y_node2->z_keys[0];
+}
+
+void merge_y_node(struct cube *cube, bsc_size w, bsc_size x, bsc_size y1, bsc_size y2)
+{
+	struct y_node *y_node1 = BSC_OWN_Y(cube, w, x, y1);
+	struct x_node *x_node = cube->w_axis[w]->x_axis[x];
+	struct y_node *y_node2 = x_node->y_axis[y2];
+
+	BSC_STAT(cube, y_merges, 1);
+
+	memcpy(&y_node1->z_keys[x_node->z_size[y1]], &y_node2->z_keys[0], x_node->z_size[y2] * sizeof(bsc_key));
+	memcpy(&y_node1->z_vals[x_node->z_size[y1]], &y_node2->z_vals[0], x_node->z_size[y2] * sizeof(bsc_val));
+
+	x_node->z_size[y1] += x_node->z_size[y2];
+
+	remove_y_node(cube, w, x, y2);
+}
+
+// Moves the cursor to the key at (w, x, y, z), stepping to the next z axis when z is past the end.
+
+int load_cursor(struct cursor *cursor, bsc_size w, bsc_size x, bsc_size y, bsc_size z)
+{
+	struct cube *cube = cursor->cube;
+
+	if (z >= cube->w_axis[w]->x_axis[x]->z_size[y])
+	{
+		z = 0;
+
+		if (++y == cube->w_axis[w]->y_size[x])
+		{
+			y = 0;
+
+			if (++x == cube->x_size[w])
+			{
+				x = 0;
+
+				if (++w == cube->w_size)
+				{
+					return cursor->valid = 0;
+				}
+			}
+		}
+	}
+
+	cursor->w = w;
+	cursor->x = x;
+	cursor->y = y;
+	cursor->z = z;
+
+	cursor->y_node = cube->w_axis[w]->x_axis[x]->y_axis[y];
+	cursor->z_size = cube->w_axis[w]->x_axis[x]->z_size[y];
+	cursor->stamp = cube->stamp;
+
+	cursor->key = cursor->y_node->z_keys[z];
+
+	return cursor->valid = 1;
+}
+
+// Positions the cursor on the first key >= key, returns 0 if there is none.
+
+int seek_cursor(struct cube *cube, struct cursor *cursor, bsc_key key)
+{
+	bsc_size w, x, y, z;
+
+	flush_cube(cube);
+
+	cursor->cube = cube;
+
+	if (cube->w_size == 0)
+	{
+		return cursor->valid = 0;
+	}
+
+	find_key(cube, key, &w, &x, &y, &z);
+
+	return load_cursor(cursor, w, x, y, z);
+}
+
+// Returns 1 if the cursor still points at its key, otherwise it is moved to the first key > its key.
+
+int check_cursor(struct cursor *cursor)
+{
+	struct cube *cube = cursor->cube;
+	bsc_size w = cursor->w, x = cursor->x, y = cursor->y, z = cursor->z;
+	bsc_key key;
+
+	flush_cube(cube);
+
+	if (cursor->stamp == cube->stamp)
+	{
+		return 1;
+	}
+
+	if (w < cube->w_size && x < cube->x_size[w] && y < cube->w_axis[w]->y_size[x] && z < cube->w_axis[w]->x_axis[x]->z_size[y])
+	{
+		if (BSC_EQ(cube->w_axis[w]->x_axis[x]->y_axis[y]->z_keys[z], cursor->key))
+		{
+			return load_cursor(cursor, w, x, y, z);
+		}
+	}
+
+	key = cursor->key;
+
+	return seek_cursor(cube, cursor, key) && BSC_EQ(cursor->key, key);
+}
+
+int next_cursor(struct cursor *cursor)
+{
+	if (!cursor->valid)
+	{
+		return 0;
+	}
+
+	if (!check_cursor(cursor))
+	{
+		return cursor->valid;
+	}
+
+	if (cursor->z + 1 < cursor->z_size)
+	{
+		cursor->key = cursor->y_node->z_keys[++cursor->z];
+
+		return 1;
+	}
+	return load_cursor(cursor, cursor->w, cursor->x, cursor->y, cursor->z + 1);
+}
+
+int prev_cursor(struct cursor *cursor)
+{
+	struct cube *cube = cursor->cube;
+	bsc_size w, x, y, z;
+	bsc_key key = cursor->key;
+
+	if (!cursor->valid)
+	{
+		return 0;
+	}
+
+	if (!check_cursor(cursor))
+	{
+		if (!cursor->valid)
+		{
+			if (cube->volume == 0)
+			{
+				return 0;
+			}
+
+			// every key is smaller, continue from the last one
+
+			w = cube->w_size - 1;
+			x = cube->x_size[w] - 1;
+			y = cube->w_axis[w]->y_size[x] - 1;
+			z = cube->w_axis[w]->x_axis[x]->z_size[y] - 1;
+
+			load_cursor(cursor, w, x, y, z);
+
+			return BSC_LT(cursor->key, key);
+		}
+	}
+
+	if (cursor->z)
+	{
+		cursor->key = cursor->y_node->z_keys[--cursor->z];
+
+		return 1;
+	}
+
+	w = cursor->w;
+	x = cursor->x;
+	y = cursor->y;
+	z = cursor->z;
+
+	if (z-- == 0)
+	{
+		if (y-- == 0)
+		{
+			if (x-- == 0)
+			{
+				if (w-- == 0)
+				{
+					return cursor->valid = 0;
+				}
+				x = cube->x_size[w] - 1;
+			}
+			y = cube->w_axis[w]->y_size[x] - 1;
+		}
+		z = cube->w_axis[w]->x_axis[x]->z_size[y] - 1;
+	}
+	return load_cursor(cursor, w, x, y, z);
+}
+
+void *cursor_val(struct cursor *cursor)
+{
+	if (!cursor->valid || !check_cursor(cursor))
+	{
+		return NULL;
+	}
+	return BSC_GET_VAL(cursor->y_node->z_vals[cursor->z]);
+}
+
+// Calls func for every key in [lo, hi] in ascending order, func may modify the cube.
+
+bsc_vol range_key(struct cube *cube, bsc_key lo, bsc_key hi, void (*func) (bsc_key key, void *val, void *data), void *data)
+{
+	struct cursor cursor;
+	bsc_vol cnt = 0;
+
+	if (seek_cursor(cube, &cursor, lo))
+	{
+		while (!BSC_LT(hi, cursor.key))
+		{
+			func(cursor.key, BSC_GET_VAL(cursor.y_node->z_vals[cursor.z]), data);
+
+			cnt++;
+
+			if (!next_cursor(&cursor))
+			{
+				break;
+			}
+		}
+	}
+	return cnt;
+}
+
+void show_cube(struct cube *cube, bsc_size depth)
+{
+	struct w_node *w_node;
+	struct x_node *x_node;
+	struct y_node *y_node;
+	bsc_size w, x, y, z;
+
+	flush_cube(cube);
+
+	for (w = 0 ; w < cube->w_size ; w++)
+	{
+		w_node = cube->w_axis[w];
+
+		if (depth == 1)
+		{
+			printf("w index [%3d] x size [%3d] volume [%10lld]\n", w, cube->x_size[w], (long long) cube->w_volume[w]);
+
+			continue;
+		}
+
+		for (x = 0 ; x < cube->x_size[w] ; x++)
+		{
+			x_node = w_node->x_axis[x];
+
+			if (depth == 2)
+			{
+				printf("w [%3d] x [%3d] s [%3d] v [%10d]\n", w, x, w_node->y_size[x], w_node->x_volume[x]);
+
+				continue;
+			}
+
+			for (y = 0 ; y < w_node->y_size[x] ; y++)
+			{
+				y_node = x_node->y_axis[y];
+
+				if (depth == 3)
+				{
+					printf("w [%3d] x [%3d] y [%3d] s [%3d]\n", w, x, y, x_node->z_size[y]);
+
+					continue;
+				}
+
+				for (z = 0 ; z < x_node->z_size[y] ; z++)
+				{
+					printf("w [%3d] x [%3d] y [%3d] z [%3d] [" BSC_KEY_FMT "] (%s)\n", w, x, y, z, BSC_KEY_ARG(y_node->z_keys[z]), (char *) BSC_GET_VAL(y_node->z_vals[z]));
+				}
+			}
+		}
+	}
+}
+
+// Fill is the share of each level's allocated slots in use, the Z level is full at BSC_Z_MAX keys. The x, y and z
+// histograms count axes by size, x and y in powers of two where bucket n holds sizes below 1 << n. Bytes are the
+// nodes and axes at their allocated size, slab bytes the memory the pool holds for them. The counts stay zero
+// without BSC_STATS.
+
+struct cube_stats
+{
+	struct bsc_counts counts;
+	bsc_vol volume;
+	size_t w_nodes;
+	size_t x_nodes;
+	size_t y_nodes;
+	double w_fill;
+	double x_fill;
+	double y_fill;
+	double z_fill;
+	size_t x_hist[32];
+	size_t y_hist[32];
+	size_t z_hist[BSC_Z_MAX + 1];
+	size_t bytes;
+	size_t slab_bytes;
+};
+
+int size_bucket(bsc_size size)
+{
+	int bucket = 0;
+
+	while (size)
+	{
+		bucket++;
+		size >>= 1;
+	}
+	return bucket;
+}
+
+void cube_stats(struct cube *cube, struct cube_stats *stats)
+{
+	struct w_node *w_node;
+	struct x_node *x_node;
+	bsc_size w, x, y;
+	size_t x_max = 0, y_max = 0;
+
+	flush_cube(cube);
+
+	memset(stats, 0, sizeof(struct cube_stats));
+
+#if BSC_STATS
+	stats->counts = cube->counts;
+#endif
+	stats->volume = cube->volume;
+	stats->w_nodes = cube->w_size;
+
+	stats->bytes = sizeof(struct cube) + cube->w_max * (sizeof(bsc_key) + sizeof(struct w_node *) + sizeof(bsc_size) + sizeof(bsc_vol));
+
+#if BSC_RANK
+	stats->bytes += cube->w_tree_max * sizeof(bsc_vol);
+#endif
+#if BSC_EYTZ
+	stats->bytes += cube->w_eytz_max * sizeof(bsc_key);
+#endif
+
+	for (w = 0 ; w < cube->w_size ; w++)
+	{
+		w_node = cube->w_axis[w];
+
+		stats->x_nodes += cube->x_size[w];
+		stats->x_hist[size_bucket(cube->x_size[w])]++;
+
+		x_max += w_node->x_max;
+
+		stats->bytes += sizeof(struct w_node) + w_axis_size(w_node->x_max);
+
+#if BSC_RANK
+		stats->bytes += w_node->x_tree_max * sizeof(bsc_vol);
+#endif
+#if BSC_EYTZ
+		stats->bytes += w_node->x_eytz_max * sizeof(bsc_key);
+#endif
+#if BSC_BUFFER
+		stats->bytes += w_node->buf_keys ? BSC_BUFFER * (sizeof(bsc_key) + sizeof(bsc_val)) : 0;
+#endif
+
+		for (x = 0 ; x < cube->x_size[w] ; x++)
+		{
+			x_node = w_node->x_axis[x];
+
+			stats->y_nodes += w_node->y_size[x];
+			stats->y_hist[size_bucket(w_node->y_size[x])]++;
+
+			y_max += x_node->y_max;
+
+			stats->bytes += sizeof(struct x_node) + x_axis_size(x_node->y_max);
+
+			for (y = 0 ; y < w_node->y_size[x] ; y++)
+			{
+				stats->z_hist[x_node->z_size[y]]++;
+			}
+		}
+	}
+	stats->bytes += stats->y_nodes * sizeof(struct y_node);
+
+	stats->w_fill = cube->w_max ? (double) cube->w_size / cube->w_max : 0;
+	stats->x_fill = x_max ? (double) stats->x_nodes / x_max : 0;
+	stats->y_fill = y_max ? (double) stats->y_nodes / y_max : 0;
+	stats->z_fill = stats->y_nodes ? (double) cube->volume / (stats->y_nodes * BSC_Z_MAX) : 0;
+
+#if BSC_POOL
+	stats->slab_bytes = cube->pool.slab_cnt * BSC_SLAB_SIZE;
+#endif
+}
+
+void show_stats(struct cube *cube, char *msg)
+{
+	struct cube_stats stats;
+	int cnt;
+
+	cube_stats(cube, &stats);
+
+	printf("stats %s: volume %lld nodes %zu/%zu/%zu fill %.2f/%.2f/%.2f/%.2f bytes %zu slab bytes %zu\n", msg, (long long) stats.volume, stats.w_nodes, stats.x_nodes, stats.y_nodes, stats.w_fill, stats.x_fill, stats.y_fill, stats.z_fill, stats.bytes, stats.slab_bytes);
+
+#if BSC_STATS
+	printf("stats %s: splits %llu/%llu/%llu merges %llu/%llu/%llu moved %llu allocs %llu reallocs %llu frees %llu lookups %llu depth %.2f\n", msg, stats.counts.w_splits, stats.counts.x_splits, stats.counts.y_splits, stats.counts.w_merges, stats.counts.x_merges, stats.counts.y_merges, stats.counts.moved, stats.counts.allocs, stats.counts.reallocs, stats.counts.frees, stats.counts.lookups, stats.counts.lookups ? (double) stats.counts.lookup_depth / stats.counts.lookups : 0);
+#endif
+	printf("stats %s: z sizes", msg);
+
+	for (cnt = 0 ; cnt <= BSC_Z_MAX ; cnt++)
+	{
+		printf(" %zu", stats.z_hist[cnt]);
+	}
+	printf("\nstats %s: y sizes", msg);
+
+	for (cnt = 0 ; cnt < 32 ; cnt++)
+	{
+		printf(" %zu", stats.y_hist[cnt]);
+	}
+	printf("\nstats %s: x sizes", msg);
+
+	for (cnt = 0 ; cnt < 32 ; cnt++)
+	{
+		printf(" %zu", stats.x_hist[cnt]);
+	}
+	printf("\n");
+}
+
+// Recomputes every volume and floor from the Z axes up, returns 0 if they all match.
+
+int check_volume(struct cube *cube, char *msg)
+{
+	struct w_node *w_node;
+	struct x_node *x_node;
+	bsc_size w, x, y;
+	bsc_vol total, w_total, x_total;
+
+	for (w = total = 0 ; w < cube->w_size ; w++)
+	{
+		w_node = cube->w_axis[w];
+
+		for (x = w_total = 0 ; x < cube->x_size[w] ; x++)
+		{
+			x_node = w_node->x_axis[x];
+
+			for (y = x_total = 0 ; y < w_node->y_size[x] ; y++)
+			{
+				if (x_node->z_size[y] == 0 || !BSC_EQ(x_node->y_floor[y], x_node->y_axis[y]->z_keys[0]))
+				{
+					printf("\e[1;31mcheck volume: bad z axis %s.\e[0m\n", msg);
+					return 1;
+				}
+				x_total += x_node->z_size[y];
+			}
+
+			if (x_total != w_node->x_volume[x] || !BSC_EQ(w_node->x_floor[x], x_node->y_floor[0]))
+			{
+				printf("\e[1;31mcheck volume: bad y axis %s.\e[0m\n", msg);
+				return 1;
+			}
+			w_total += x_total;
+		}
+
+		if (w_total != cube->w_volume[w] || !BSC_EQ(cube->w_floor[w], w_node->x_floor[0]))
+		{
+			printf("\e[1;31mcheck volume: bad x axis %s.\e[0m\n", msg);
+			return 1;
+		}
+		total += w_total;
+	}
+
+	if (total != cube->volume)
+	{
+		printf("\e[1;31mcheck volume: bad w axis %s.\e[0m\n", msg);
+		return 1;
+	}
+	return 0;
+}
+
+// The walk is only paid for in BSC_STATS builds.
+
+void check_integrity(struct cube *cube, char *msg)
+{
+#if BSC_STATS
+	struct y_node *y_node;
+	bsc_size w, x, y, z;
+	bsc_key last;
+
+	if (cube->w_size == 0)
+	{
+		return;
+	}
+
+	last = cube->w_floor[0];
+
+	for (w = 0 ; w < cube->w_size ; w++)
+	{
+		for (x = 0 ; x < cube->x_size[w] ; x++)
+		{
+			for (y = 0 ; y < cube->w_axis[w]->y_size[x] ; y++)
+			{
+				for (z = 0 ; z < cube->w_axis[w]->x_axis[x]->z_size[y] ; z++)
+				{
+					y_node = cube->w_axis[w]->x_axis[x]->y_axis[y];
+
+					if (BSC_LT(y_node->z_keys[z], last))
+					{
+						printf("\e[1;31mcheck integrity: corruption %s.\e[0m\n", msg);
+						return;
+					}
+					last = y_node->z_keys[z];
+				}
+			}
+		}
+	}
+#endif
+}
+
+long long utime()
+{
+	struct timeval now_time;
+
+	gettimeofday(&now_time, NULL);
+
+	return now_time.tv_sec * 1000000LL + now_time.tv_usec;
+}
+
+long long ntime()
+{
+	struct timespec now_time;
+
+	clock_gettime(CLOCK_MONOTONIC, &now_time);
+
+	return now_time.tv_sec * 1000000000LL + now_time.tv_nsec;
+}
+
+// String keys are written to buf, with shared set they all start with the same 16 bytes.
+
+bsc_key bench_key(int num, char *buf, int shared)
+{
+#if BSC_KEY == BSC_KEY_STR
+	sprintf(buf, shared ? "/usr/share/docs/%d" : "%d", num);
+
+	return str_key(buf);
+#elif BSC_KEY == BSC_KEY_LONG
+	return (long long) num * 4294967311LL;
+#elif BSC_KEY == BSC_KEY_DOUBLE
+	return num / 7.0;
+#else
+	return num;
+#endif
+}
+
+#if !BSC_VAL_SIZE
+
+// The tsearch baseline is a red-black tree with a node per key, the layout of std::map.
+
+struct key_pair
+{
+	bsc_key key;
+	void *val;
+};
+
+int compare_key(const void *a, const void *b)
+{
+	const struct key_pair *pa = (const struct key_pair *) a;
+	const struct key_pair *pb = (const struct key_pair *) b;
+
+	return BSC_LT(pa->key, pb->key) ? -1 : BSC_LT(pb->key, pa->key) ? 1 : 0;
+}
+
+#endif
+
+#if BSC_KEY == BSC_KEY_INT && !BSC_VAL_SIZE
+
+// Inserts in random, forward and reverse order, the random cube is drained from the end with del_index.
+
+void bench_orders(int max)
+{
+	struct cube *cube;
+	long long start, end;
+	void *val;
+	int cnt;
+
+	val = strdup("value");
+
+	cube = create_cube();
+	start = utime();
+	srand(10);
+
+	for (cnt = 1 ; cnt <= max ; cnt++)
+	{
+		set_key(cube, 0 + rand(), val);
+	}
+	end = utime();
+	printf("Time to insert %d elements: %f seconds. (random order) (w_size %d)\n", max, (end - start) / 1000000.0, cube->w_size);
+
+	check_integrity(cube, "rnd order");
+
+#if BSC_STATS
+	show_stats(cube, "rnd order");
+#endif
+
+	srand(10);
+
+	while (cube->volume)
+	{
+		del_index(cube, cube->volume - 1);
+	}
+	end = utime();
+	printf("Time to delete %d elements: %f seconds. (random order) (w_size %d)\n", max, (end - start) / 1000000.0, cube->w_size);
+
+	destroy_cube(cube);
+
+	cube = create_cube();
+	start = utime();
+	for (cnt = 1 ; cnt <= max ; cnt++)
+	{
+		set_key(cube, 0 + cnt, "fwd order");
+	}
+	end = utime();
+	printf("Time to insert %d elements: %f seconds. (forward order)\n", max, (end - start) / 1000000.0);
+
+	check_integrity(cube, "fwd order");
+
+	destroy_cube(cube);
+
+	cube = create_cube();
+	start = utime();
+	for (cnt = 1 ; cnt <= max ; cnt++)
+	{
+		set_key(cube, max - cnt, "rev order");
+	}
+	end = utime();
+
+	check_integrity(cube, "rev order");
+
+	printf("Time to insert %d elements: %f seconds. (reverse order)\n", max, (end - start) / 1000000.0);
+	destroy_cube(cube);
+
+	free(val);
+}
+
+void bench_sorted(int max)
+{
+	static float fills[] = { 1.0f, 0.75f, 0.5f };
+	struct cube *cube;
+	long long start, end;
+	int cnt, *keys;
+	void **vals;
+
+	keys = (int *) malloc(max * sizeof(int));
+	vals = (void **) malloc(max * sizeof(void *));
+
+	for (cnt = 0 ; cnt < max ; cnt++)
+	{
+		keys[cnt] = cnt + 1;
+		vals[cnt] = "fwd order";
+	}
+
+	for (cnt = 0 ; cnt < 3 ; cnt++)
+	{
+		start = utime();
+
+		cube = cube_from_sorted(keys, vals, max, fills[cnt]);
+
+		end = utime();
+
+		printf("Time to load %d elements: %f seconds. (cube_from_sorted fill %.2f) (w_size %d)\n", max, (end - start) / 1000000.0, fills[cnt], cube->w_size);
+
+		check_integrity(cube, "sorted load");
+
+		destroy_cube(cube);
+	}
+	free(keys);
+	free(vals);
+}
+
+int compare_int(const void *a, const void *b)
+{
+	return *(int *) a < *(int *) b ? -1 : *(int *) a > *(int *) b;
+}
+
+void bench_sorted_batch(int max)
+{
+	static int batches[] = { 100, 10000, 1000000 };
+	struct cube *cube;
+	long long start, end;
+	int cnt, step, size, *keys;
+	void **vals;
+
+	keys = (int *) malloc(max * sizeof(int));
+	vals = (void **) malloc(max * sizeof(void *));
+
+	for (step = 0 ; step < 3 ; step++)
+	{
+		size = batches[step] < max ? batches[step] : max;
+
+		srand(10);
+
+		for (cnt = 0 ; cnt < max ; cnt++)
+		{
+			keys[cnt] = rand();
+			vals[cnt] = "rnd order";
+		}
+
+		for (cnt = 0 ; cnt < max ; cnt += size)
+		{
+			qsort(&keys[cnt], cnt + size < max ? size : max - cnt, sizeof(int), compare_int);
+		}
+
+		cube = create_cube();
+
+		start = utime();
+
+		for (cnt = 0 ; cnt < max ; cnt++)
+		{
+			set_key(cube, keys[cnt], vals[cnt]);
+		}
+		end = utime();
+
+		printf("Time to insert %d elements: %f seconds. (set_key batches of %d)\n", max, (end - start) / 1000000.0, size);
+
+		destroy_cube(cube);
+
+		cube = create_cube();
+
+		start = utime();
+
+		for (cnt = 0 ; cnt < max ; cnt += size)
+		{
+			set_key_sorted_batch(cube, &keys[cnt], &vals[cnt], cnt + size < max ? size : max - cnt);
+		}
+		end = utime();
+
+		printf("Time to insert %d elements: %f seconds. (set_key_sorted_batch batches of %d)\n", max, (end - start) / 1000000.0, size);
+
+		check_integrity(cube, "sorted batch");
+
+		destroy_cube(cube);
+	}
+	free(keys);
+	free(vals);
+}
+
+void bench_hint(int max)
+{
+	struct cube *cube;
+	struct hint hint = { 0, 0, 0 };
+	long long start, end;
+	int cnt, key, total;
+
+	cube = create_cube();
+
+	start = utime();
+
+	for (cnt = 1 ; cnt <= max ; cnt++)
+	{
+		set_key_hint(cube, cnt, "fwd order", &hint);
+	}
+	end = utime();
+
+	printf("Time to insert %d elements: %f seconds. (forward order set_key_hint)\n", max, (end - start) / 1000000.0);
+
+	check_integrity(cube, "fwd hint");
+
+	start = utime();
+
+	for (cnt = 1, total = 0 ; cnt <= max ; cnt++)
+	{
+		total += get_key(cube, cnt) != NULL;
+	}
+	end = utime();
+
+	printf("Time to find %d elements: %f seconds. (forward order get_key)\n", total, (end - start) / 1000000.0);
+
+	start = utime();
+
+	for (cnt = 1, total = 0 ; cnt <= max ; cnt++)
+	{
+		total += get_key_hint(cube, cnt, &hint) != NULL;
+	}
+	end = utime();
+
+	printf("Time to find %d elements: %f seconds. (forward order get_key_hint)\n", total, (end - start) / 1000000.0);
+
+	srand(10);
+
+	start = utime();
+
+	for (cnt = total = 0, key = max / 2 ; cnt < max ; cnt++)
+	{
+		key += rand() % 2001 - 1000;
+
+		total += get_key(cube, key) != NULL;
+	}
+	end = utime();
+
+	printf("Time to find %d elements: %f seconds. (random walk get_key)\n", total, (end - start) / 1000000.0);
+
+	srand(10);
+
+	start = utime();
+
+	for (cnt = total = 0, key = max / 2 ; cnt < max ; cnt++)
+	{
+		key += rand() % 2001 - 1000;
+
+		total += get_key_hint(cube, key, &hint) != NULL;
+	}
+	end = utime();
+
+	printf("Time to find %d elements: %f seconds. (random walk get_key_hint)\n", total, (end - start) / 1000000.0);
+
+	destroy_cube(cube);
+}
+
+// Binary min heap used as the baseline for the priority queue calls.
+
+struct heap_node
+{
+	int key;
+	void *val;
+};
+
+void heap_push(struct heap_node *heap, int *size, int key, void *val)
+{
+	int i = (*size)++;
+
+	while (i && heap[(i - 1) / 2].key > key)
+	{
+		heap[i] = heap[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	heap[i].key = key;
+	heap[i].val = val;
+}
+
+void *heap_pop(struct heap_node *heap, int *size, int *key)
+{
+	struct heap_node last;
+	void *val;
+	int i, c;
+
+	*key = heap[0].key;
+	val = heap[0].val;
+
+	last = heap[--*size];
+
+	for (i = 0 ; (c = i * 2 + 1) < *size ; i = c)
+	{
+		if (c + 1 < *size && heap[c + 1].key < heap[c].key)
+		{
+			c++;
+		}
+		if (last.key <= heap[c].key)
+		{
+			break;
+		}
+		heap[i] = heap[c];
+	}
+	heap[i] = last;
+
+	return val;
+}
+
+void bench_queue(int max)
+{
+	struct heap_node *heap;
+	struct cube *cube;
+	long long start, end;
+	int cnt, key, size = 0;
+
+	heap = (struct heap_node *) malloc(max * sizeof(struct heap_node));
+
+	srand(10);
+
+	start = utime();
+
+	for (cnt = 0 ; cnt < max ; cnt++)
+	{
+		heap_push(heap, &size, rand(), "rnd order");
+	}
+	while (size)
+	{
+		heap_pop(heap, &size, &key);
+	}
+	end = utime();
+
+	printf("Time to push and pop %d elements: %f seconds. (binary heap)\n", max, (end - start) / 1000000.0);
+
+	free(heap);
+
+	cube = create_cube();
+
+	srand(10);
+
+	start = utime();
+
+	for (cnt = 0 ; cnt < max ; cnt++)
+	{
+		push(cube, rand(), "rnd order");
+	}
+	while (cube->volume)
+	{
+		pop_min(cube, &key);
+	}
+	end = utime();
+
+	printf("Time to push and pop %d elements: %f seconds. (push pop_min)\n", max, (end - start) / 1000000.0);
+
+	for (cnt = 0 ; cnt < max ; cnt++)
+	{
+		push(cube, cnt, "fwd order");
+	}
+
+	start = utime();
+
+	while (cube->volume)
+	{
+		del_index(cube, cube->volume - 1);
+	}
+	end = utime();
+
+	printf("Time to delete %d elements: %f seconds. (del_index volume - 1)\n", max, (end - start) / 1000000.0);
+
+	start = utime();
+
+	for (cnt = 0 ; cnt < max ; cnt++)
+	{
+		push(cube, cnt, "fwd order");
+	}
+	end = utime();
+
+	printf("Time to insert %d elements: %f seconds. (forward order push)\n", max, (end - start) / 1000000.0);
+
+	start = utime();
+
+	while (cube->volume)
+	{
+		pop_max(cube, NULL);
+	}
+	end = utime();
+
+	printf("Time to delete %d elements: %f seconds. (pop_max)\n", max, (end - start) / 1000000.0);
+
+	destroy_cube(cube);
+}
+
+void bench_cubesort(int max)
+{
+	static char *names[] = { "random", "ascending", "descending", "mostly sorted" };
+	long long start, end;
+	int cnt, type, *array, *input;
+
+	array = (int *) malloc(max * sizeof(int));
+	input = (int *) malloc(max * sizeof(int));
+
+	for (type = 0 ; type < 4 ; type++)
+	{
+		srand(10);
+
+		for (cnt = 0 ; cnt < max ; cnt++)
+		{
+			switch (type)
+			{
+				case 0: input[cnt] = rand(); break;
+				case 1: input[cnt] = cnt; break;
+				case 2: input[cnt] = max - cnt; break;
+				case 3: input[cnt] = rand() % 100 ? cnt : rand() % max; break;
+			}
+		}
+
+		memcpy(array, input, max * sizeof(int));
+
+		start = utime();
+
+		qsort(array, max, sizeof(int), compare_int);
+
+		end = utime();
+
+		printf("Time to sort %d elements: %f seconds. (qsort %s)\n", max, (end - start) / 1000000.0, names[type]);
+
+		memcpy(array, input, max * sizeof(int));
+
+		start = utime();
+
+		cubesort(array, max);
+
+		end = utime();
+
+		printf("Time to sort %d elements: %f seconds. (cubesort %s)\n", max, (end - start) / 1000000.0, names[type]);
+
+		for (cnt = 1 ; cnt < max ; cnt++)
+		{
+			if (array[cnt - 1] > array[cnt])
+			{
+				printf("cubesort: %s not sorted at index %d\n", names[type], cnt);
+				break;
+			}
+		}
+	}
+	free(array);
+	free(input);
+}
+
+void bench_buffer(int max)
+{
+	char *mode = BSC_BUFFER ? "buffered" : "unbuffered";
+	struct cube *cube;
+	long long start, end;
+	int cnt, total;
+
+	cube = create_cube();
+
+	srand(10);
+
+	start = utime();
+
+	for (cnt = 0 ; cnt < max ; cnt++)
+	{
+		set_key(cube, rand(), "rnd order");
+	}
+	end = utime();
+
+	printf("Time to insert %d elements: %f seconds. (%s)\n", max, (end - start) / 1000000.0, mode);
+
+	srand(10);
+
+	start = utime();
+
+	for (cnt = total = 0 ; cnt < max ; cnt++)
+	{
+		total += get_key(cube, rand()) != NULL;
+	}
+	end = utime();
+
+	printf("Time to find %d elements: %f seconds. (%s)\n", total, (end - start) / 1000000.0, mode);
+
+	start = utime();
+
+	flush_cube(cube);
+
+	end = utime();
+
+	printf("Time to flush %lld elements: %f seconds. (%s)\n", (long long) cube->volume, (end - start) / 1000000.0, mode);
+
+	destroy_cube(cube);
+}
+
+// Meant for BSC_LARGE. Pass a size of 1000000000 for the billion key run, forward order leaves the Z axes half
+// full so that needs about 25 GB.
+
+void bench_large(long long size)
+{
+	struct cube *cube;
+	long long start, end, cnt;
+	int total;
+
+	cube = create_cube();
+
+	start = utime();
+
+	for (cnt = 0 ; cnt < size ; cnt++)
+	{
+		set_key(cube, (int) cnt, "fwd order");
+	}
+	end = utime();
+
+	printf("Time to insert %lld elements: %f seconds. (forward order) (w_size %d) (m_size %d)\n", size, (end - start) / 1000000.0, cube->w_size, cube->m_size);
+
+	srand(10);
+
+	start = utime();
+
+	for (cnt = total = 0 ; cnt < 10000000 ; cnt++)
+	{
+		total += get_key(cube, (int) (((long long) rand() * RAND_MAX + rand()) % size)) != NULL;
+	}
+	end = utime();
+
+	printf("Time to find %d elements: %f seconds. (random order)\n", total, (end - start) / 1000000.0);
+
+	start = utime();
+
+	for (cnt = total = 0 ; cnt < 1000000 ; cnt++)
+	{
+		total += get_index(cube, ((long long) rand() * RAND_MAX + rand()) % cube->volume) != NULL;
+	}
+	end = utime();
+
+	printf("Time to get %d indexes: %f seconds. (random order)\n", total, (end - start) / 1000000.0);
+
+	if (check_volume(cube, "large cube") == 0)
+	{
+		printf("Volume of %lld elements checks out.\n", (long long) cube->volume);
+	}
+	destroy_cube(cube);
+}
+
+void bench_export(int max)
+{
+	struct cube *cube;
+	long long start, end;
+	int cnt, *keys, total;
+	void **vals;
+
+	keys = (int *) malloc(max * sizeof(int));
+	vals = (void **) malloc(max * sizeof(void *));
+
+	cube = create_cube();
+
+	srand(10);
+
+	for (cnt = 0 ; cnt < max ; cnt++)
+	{
+		set_key(cube, rand(), "rnd order");
+	}
+
+	start = utime();
+
+	for (cnt = 0 ; cnt < cube->volume ; cnt++)
+	{
+		vals[cnt] = get_index(cube, cnt);
+	}
+	end = utime();
+
+	printf("Time to export %lld elements: %f seconds. (get_index)\n", (long long) cube->volume, (end - start) / 1000000.0);
+
+	start = utime();
+
+	total = cube_to_array(cube, keys, vals);
+
+	end = utime();
+
+	printf("Time to export %d elements: %f seconds. (cube_to_array)\n", total, (end - start) / 1000000.0);
+
+	start = utime();
+
+	total = cube_to_array_mt(cube, keys, vals, 4);
+
+	end = utime();
+
+	printf("Time to export %d elements: %f seconds. (cube_to_array_mt 4 threads)\n", total, (end - start) / 1000000.0);
+
+	destroy_cube(cube);
+
+	free(keys);
+	free(vals);
+}
+
+void count_scan(int key, void *val, void *data)
+{
+	++*(int *) data;
+}
+
+void bench_range(int max)
+{
+	struct cube *cube;
+	struct cursor cursor;
+	long long start, end;
+	int cnt, index, total, scan = 100;
+	bsc_size w = 0, x = 0, y = 0, z = 0;
+
+	cube = create_cube();
+
+	srand(10);
+
+	for (cnt = 0 ; cnt < max ; cnt++)
+	{
+		set_key(cube, rand(), "rnd order");
+	}
+
+	srand(20);
+
+	start = utime();
+
+	for (cnt = total = 0 ; cnt < max / scan ; cnt++)
+	{
+		index = rand() % cube->volume;
+
+		for (z = 0 ; z < scan && index < cube->volume ; z++, index++)
+		{
+			total += get_index(cube, index) != NULL;
+		}
+	}
+	end = utime();
+
+	printf("Time to scan %d elements: %f seconds. (get_index)\n", total, (end - start) / 1000000.0);
+
+	srand(20);
+
+	start = utime();
+
+	for (cnt = total = 0 ; cnt < max / scan ; cnt++)
+	{
+		find_index(cube, rand() % cube->volume, &w, &x, &y, &z);
+
+		seek_cursor(cube, &cursor, cube->w_axis[w]->x_axis[x]->y_axis[y]->z_keys[z]);
+
+		for (z = 0 ; z < scan && cursor.valid ; z++)
+		{
+			total += cursor_val(&cursor) != NULL;
+
+			next_cursor(&cursor);
+		}
+	}
+	end = utime();
+
+	printf("Time to scan %d elements: %f seconds. (cursor)\n", total, (end - start) / 1000000.0);
+
+	start = utime();
+
+	total = 0;
+
+	cnt = range_key(cube, 0, RAND_MAX, count_scan, &total);
+
+	end = utime();
+
+	printf("Time to scan %d elements: %f seconds. (range_key)\n", cnt, (end - start) / 1000000.0);
+
+	destroy_cube(cube);
+}
+
+void bench_rank(int max)
+{
+	char *mode = BSC_RANK ? "rank tree" : "linear";
+	struct cube *cube;
+	long long start, end;
+	int cnt, total;
+
+	cube = create_cube();
+
+	srand(10);
+
+	for (cnt = 0 ; cnt < max ; cnt++)
+	{
+		set_key(cube, rand(), "rnd order");
+	}
+
+	start = utime();
+
+	for (cnt = total = 0 ; cnt < max ; cnt++)
+	{
+		total += get_index(cube, rand() % cube->volume) != NULL;
+	}
+	end = utime();
+
+	printf("Time to get %d indexes: %f seconds. (%s)\n", total, (end - start) / 1000000.0, mode);
+
+	start = utime();
+
+	for (cnt = total = 0 ; cnt < max ; cnt++)
+	{
+		total += key_rank(cube, rand()) >= 0;
+	}
+	end = utime();
+
+	printf("Time to rank %d keys: %f seconds. (%s)\n", total, (end - start) / 1000000.0, mode);
+
+	start = utime();
+
+	while (cube->volume)
+	{
+		del_index(cube, cube->volume - 1);
+	}
+	end = utime();
+
+	printf("Time to delete %d indexes: %f seconds. (%s)\n", max, (end - start) / 1000000.0, mode);
+
+	destroy_cube(cube);
+}
+
+void bench_batch(int max)
+{
+	struct cube *cube;
+	long long start, end;
+	int cnt, size, total, *keys;
+	void **vals;
+
+	for (size = max < 1000000 ? max : 1000000 ; size <= max ; size *= 10)
+	{
+		keys = (int *) malloc(size * sizeof(int));
+		vals = (void **) malloc(size * sizeof(void *));
+
+		cube = create_cube();
+
+		srand(10);
+
+		for (cnt = 0 ; cnt < size ; cnt++)
+		{
+			keys[cnt] = rand();
+
+			set_key(cube, keys[cnt], keys);
+		}
+
+		for (cnt = 0 ; cnt < size ; cnt++)
+		{
+			keys[cnt] = keys[rand() % size];
+		}
+
+		start = utime();
+
+		for (cnt = total = 0 ; cnt < size ; cnt++)
+		{
+			total += get_key(cube, keys[cnt]) != NULL;
+		}
+		end = utime();
+
+		printf("Time to find %d elements: %f seconds. (get_key)\n", total, (end - start) / 1000000.0);
+
+		start = utime();
+
+		get_key_batch(cube, keys, size, vals);
+
+		end = utime();
+
+		for (cnt = total = 0 ; cnt < size ; cnt++)
+		{
+			total += vals[cnt] != NULL;
+		}
+
+		printf("Time to find %d elements: %f seconds. (get_key_batch)\n", total, (end - start) / 1000000.0);
+
+		destroy_cube(cube);
+
+		free(keys);
+		free(vals);
+	}
+}
+
+void bench_search(int max)
+{
+	static char *names[] = { "quaternary", "sse4.1", "avx2" };
+	struct cube *cube;
+	long long start, end;
+	int cnt, *keys, level, simd, found;
+
+	keys = (int *) malloc(max * sizeof(int));
+
+	cube = create_cube();
+
+	srand(10);
+
+	for (cnt = 0 ; cnt < max ; cnt++)
+	{
+		keys[cnt] = rand();
+
+		set_key(cube, keys[cnt], keys);
+	}
+
+	simd = bsc_simd_level;
+
+	for (level = 0 ; level <= simd ; level++)
+	{
+		bsc_simd_level = level;
+
+		start = utime();
+
+		for (cnt = found = 0 ; cnt < max ; cnt++)
+		{
+			found += get_key(cube, keys[cnt]) != NULL;
+		}
+		end = utime();
+
+		printf("Time to find %d elements: %f seconds. (%s) (found %d)\n", max, (end - start) / 1000000.0, names[level], found);
+	}
+	bsc_simd_level = simd;
+
+	destroy_cube(cube);
+
+	free(keys);
+}
+
+void bench_snapshot(int max)
+{
+	static char *path = "binary_cube.snapshot";
+	struct cube *cube, *copy;
+	long long start, end;
+	int cnt, hits;
+
+	cube = create_cube();
+
+	srand(10);
+
+	start = utime();
+
+	for (cnt = 0 ; cnt < max ; cnt++)
+	{
+		set_key(cube, rand(), (void *) (long) (cnt + 1));
+	}
+	end = utime();
+
+	printf("Time to insert %d elements: %f seconds. (rebuild)\n", max, (end - start) / 1000000.0);
+
+	start = utime();
+
+	if (cube_save(cube, path))
+	{
+		printf("cube_save(%s) failed\n", path);
+
+		destroy_cube(cube);
+
+		return;
+	}
+	end = utime();
+
+	printf("Time to save %d elements: %f seconds. (snapshot)\n", max, (end - start) / 1000000.0);
+
+	start = utime();
+
+	copy = cube_open_mmap(path);
+
+	end = utime();
+
+	printf("Time to open %d elements: %f seconds. (snapshot)\n", max, (end - start) / 1000000.0);
+
+	check_integrity(copy, "snapshot");
+
+	srand(10);
+
+	start = utime();
+
+	for (cnt = hits = 0 ; cnt < max ; cnt++)
+	{
+		hits += get_key(copy, rand()) != NULL;
+	}
+	end = utime();
+
+	printf("Time to get %d elements: %f seconds. (snapshot) (hits %d)\n", max, (end - start) / 1000000.0, hits);
+
+	// writes copy the touched pages and move grown arrays to the heap
+
+	start = utime();
+
+	for (cnt = 0 ; cnt < max ; cnt++)
+	{
+		if (cnt % 2)
+		{
+			del_key(copy, rand());
+		}
+		else
+		{
+			set_key(copy, rand(), "snapshot");
+		}
+	}
+	end = utime();
+
+	printf("Time to update %d elements: %f seconds. (snapshot) (volume %lld)\n", max, (end - start) / 1000000.0, (long long) copy->volume);
+
+	check_integrity(copy, "snapshot");
+
+	destroy_cube(copy);
+	destroy_cube(cube);
+
+	remove(path);
+}
+
+#if BSC_MVCC
+
+struct mvcc_job
+{
+	struct cube *snap;
+	int scans;
+	int total;
+};
+
+void *mvcc_job(void *arg)
+{
+	struct mvcc_job *job = (struct mvcc_job *) arg;
+	int cnt;
+
+	for (cnt = 0 ; cnt < job->scans ; cnt++)
+	{
+		job->total = 0;
+
+		range_key(job->snap, 0, RAND_MAX, count_scan, &job->total);
+	}
+	return NULL;
+}
+
+// Updates the cube without a snapshot, while a thread scans a snapshot, and after it was released.
+
+void bench_mvcc(int max)
+{
+	static char *modes[] = { "no snapshot", "snapshot scanned", "snapshot released" };
+	struct mvcc_job job;
+	struct cursor cursor;
+	pthread_t thread;
+	struct cube *cube;
+	bsc_key key;
+	long long start, end;
+	int mode, cnt;
+
+	cube = create_cube();
+
+	srand(11);
+
+	for (cnt = 0 ; cnt < max ; cnt++)
+	{
+		set_key(cube, rand(), "mvcc");
+	}
+
+	for (mode = 0 ; mode < 3 ; mode++)
+	{
+		if (mode == 1)
+		{
+			start = utime();
+
+			job.snap = cube_snapshot(cube);
+
+			end = utime();
+
+			printf("Time to snapshot %lld elements: %f seconds. (mvcc)\n", (long long) cube->volume, (end - start) / 1000000.0);
+
+			job.scans = 4;
+
+			pthread_create(&thread, NULL, mvcc_job, &job);
+		}
+
+		start = utime();
+
+		for (cnt = 0 ; cnt < max ; cnt++)
+		{
+			if (cnt % 2)
+			{
+				del_key(cube, rand());
+			}
+			else
+			{
+				set_key(cube, rand(), "mvcc");
+			}
+		}
+		end = utime();
+
+		printf("Time to update %d elements: %f seconds. (%s) (retired %zu)\n", max, (end - start) / 1000000.0, modes[mode], cube->retired_size);
+
+		if (mode == 1)
+		{
+			pthread_join(thread, NULL);
+
+			end = utime();
+
+			printf("Time to scan %lld elements %d times: %f seconds. (mvcc) (scanned %d)\n", (long long) job.snap->volume, job.scans, (end - start) / 1000000.0, job.total);
+
+			release_snapshot(job.snap);
+		}
+	}
+
+	// a cursor must leave a y_node that a write copied away from a snapshot, the release frees it on the next write
+
+	if (seek_cursor(cube, &cursor, rand()))
+	{
+		key = cursor.key;
+
+		job.snap = cube_snapshot(cube);
+
+		set_key(cube, key, "mvcc");
+
+		release_snapshot(job.snap);
+
+		set_key(cube, cube->w_floor[cube->w_size - 1], "mvcc");
+
+		if (next_cursor(&cursor) && !BSC_LT(key, cursor.key))
+		{
+			printf("\e[1;31mcheck cursor: stale y_node mvcc.\e[0m\n");
+		}
+	}
+	check_integrity(cube, "mvcc");
+
+	destroy_cube(cube);
+}
+#endif
+
+// Ingests with 1 to 8 shards and one producer thread per shard, then rebalances a single loaded shard and reads
+// it back. The thread scaling of this and of bench_mt is unmeasured, they were only run on a single core.
+
+struct shard_job
+{
+	struct shard_cube *sc;
+	int producer;
+	int cnt;
+	unsigned int seed;
+};
+
+void *shard_job(void *arg)
+{
+	struct shard_job *job = (struct shard_job *) arg;
+	unsigned int rnd = job->seed;
+	int cnt;
+
+	for (cnt = 0 ; cnt < job->cnt ; cnt++)
+	{
+		rnd ^= rnd << 13;
+		rnd ^= rnd >> 17;
+		rnd ^= rnd << 5;
+
+		shard_set_key(job->sc, job->producer, rnd & 0x7fffffff, "shard");
+	}
+	return NULL;
+}
+
+void bench_shard(int max)
+{
+	struct shard_job jobs[8];
+	pthread_t tids[8];
+	struct shard_cube *sc;
+	int splits[8];
+	unsigned int rnd;
+	long long start, end;
+	int size, cnt, hits;
+
+	// one producer per shard, the splits cut the key range into equal parts
+
+	for (size = 1 ; size <= 8 ; size *= 2)
+	{
+		for (cnt = 1 ; cnt < size ; cnt++)
+		{
+			splits[cnt - 1] = 0x7fffffff / size * cnt;
+		}
+		sc = create_shard_cube(size, size, splits);
+
+		start = utime();
+
+		for (cnt = 0 ; cnt < size ; cnt++)
+		{
+			jobs[cnt].sc = sc;
+			jobs[cnt].producer = cnt;
+			jobs[cnt].cnt = max / size;
+			jobs[cnt].seed = 2463534242U + cnt * 7919;
+
+			pthread_create(&tids[cnt], NULL, shard_job, &jobs[cnt]);
+		}
+
+		for (cnt = 0 ; cnt < size ; cnt++)
+		{
+			pthread_join(tids[cnt], NULL);
+		}
+		shard_flush(sc);
+
+		end = utime();
+
+		printf("Time to insert %d elements: %f seconds. (%d shards) (volume %lld)\n", max, (end - start) / 1000000.0, size, (long long) shard_volume(sc));
+
+		destroy_shard_cube(sc);
+	}
+
+	// without splits every key lands in shard 0 until the flush spreads them out
+
+	sc = create_shard_cube(4, 1, NULL);
+
+	jobs[0].sc = sc;
+	jobs[0].producer = 0;
+	jobs[0].cnt = max;
+	jobs[0].seed = 2463534242U;
+
+	shard_job(&jobs[0]);
+
+	drain_shards(sc);
+
+	start = utime();
+
+	shard_flush(sc);
+
+	end = utime();
+
+	printf("Time to rebalance %d elements: %f seconds. (4 shards) (shard 0 volume %lld)\n", max, (end - start) / 1000000.0, (long long) sc->shards[0].cube->volume);
+
+	start = utime();
+
+	for (cnt = hits = 0, rnd = jobs[0].seed ; cnt < max ; cnt++)
+	{
+		rnd ^= rnd << 13;
+		rnd ^= rnd >> 17;
+		rnd ^= rnd << 5;
+
+		hits += shard_get_key(sc, rnd & 0x7fffffff) != NULL;
+	}
+	end = utime();
+
+	printf("Time to get %d elements: %f seconds. (4 shards) (hits %d)\n", max, (end - start) / 1000000.0, hits);
+
+	destroy_shard_cube(sc);
+}
+
+#elif !BSC_VAL_SIZE
+
+void bench_keys(int max, int shared)
+{
+	struct key_pair *pairs;
+	struct cube *cube;
+	void *root = NULL;
+	char *strs;
+	long long start, end;
+	int cnt, found;
+
+	pairs = (struct key_pair *) malloc(max * sizeof(struct key_pair));
+	strs = (char *) malloc(max * 32);
+
+	srand(10);
+
+	for (cnt = 0 ; cnt < max ; cnt++)
+	{
+		pairs[cnt].key = bench_key(rand(), &strs[cnt * 32], shared);
+		pairs[cnt].val = &pairs[cnt];
+	}
+
+	cube = create_cube();
+
+	start = utime();
+
+	for (cnt = 0 ; cnt < max ; cnt++)
+	{
+		set_key(cube, pairs[cnt].key, pairs[cnt].val);
+	}
+	end = utime();
+
+	printf("Time to insert %d elements: %f seconds. (binary cube) (%s)\n", max, (end - start) / 1000000.0, shared ? "shared prefix" : "random");
+
+	start = utime();
+
+	for (cnt = found = 0 ; cnt < max ; cnt++)
+	{
+		found += get_key(cube, pairs[cnt].key) != NULL;
+	}
+	end = utime();
+
+	printf("Time to get %d elements: %f seconds. (binary cube) (found %d)\n", max, (end - start) / 1000000.0, found);
+
+	start = utime();
+
+	for (cnt = 0 ; cnt < max ; cnt++)
+	{
+		del_key(cube, pairs[cnt].key);
+	}
+	end = utime();
+
+	printf("Time to delete %d elements: %f seconds. (binary cube)\n", max, (end - start) / 1000000.0);
+
+	destroy_cube(cube);
+
+	start = utime();
+
+	for (cnt = 0 ; cnt < max ; cnt++)
+	{
+		tsearch(&pairs[cnt], &root, compare_key);
+	}
+	end = utime();
+
+	printf("Time to insert %d elements: %f seconds. (tsearch) (%s)\n", max, (end - start) / 1000000.0, shared ? "shared prefix" : "random");
+
+	start = utime();
+
+	for (cnt = found = 0 ; cnt < max ; cnt++)
+	{
+		found += tfind(&pairs[cnt], &root, compare_key) != NULL;
+	}
+	end = utime();
+
+	printf("Time to get %d elements: %f seconds. (tsearch) (found %d)\n", max, (end - start) / 1000000.0, found);
+
+	start = utime();
+
+	for (cnt = 0 ; cnt < max ; cnt++)
+	{
+		tdelete(&pairs[cnt], &root, compare_key);
+	}
+	end = utime();
+
+	printf("Time to delete %d elements: %f seconds. (tsearch)\n", max, (end - start) / 1000000.0);
+
+	free(pairs);
+	free(strs);
+}
+#endif
+
+// A 16 byte value read after every hit, it lives in the Z axis with BSC_VAL_SIZE and in a separate array without.
+
+struct bench_val
+{
+	long long id;
+	long long sum;
+};
+
+void bench_values(int max)
+{
+	struct bench_val *vals;
+	struct cube *cube;
+	bsc_key *keys;
+	char *strs;
+	long long start, end, sum;
+	int cnt;
+
+	if (BSC_VAL_SIZE && BSC_VAL_SIZE < sizeof(struct bench_val))
+	{
+		return;
+	}
+
+	keys = (bsc_key *) malloc(max * sizeof(bsc_key));
+	vals = (struct bench_val *) malloc(max * sizeof(struct bench_val));
+	strs = (char *) malloc(max * 32);
+
+	cube = create_cube();
+
+	srand(10);
+
+	for (cnt = 0 ; cnt < max ; cnt++)
+	{
+		keys[cnt] = bench_key(rand(), &strs[cnt * 32], 0);
+
+		vals[cnt].id = cnt;
+		vals[cnt].sum = cnt;
+	}
+
+	start = utime();
+
+	for (cnt = 0 ; cnt < max ; cnt++)
+	{
+		set_key(cube, keys[cnt], &vals[cnt]);
+	}
+	end = utime();
+
+	printf("Time to insert %d elements: %f seconds. (%d byte values)\n", max, (end - start) / 1000000.0, BSC_VAL_SIZE);
+
+	// visit the keys out of insertion order so the value array is not read sequentially
+
+	start = utime();
+
+	for (cnt = sum = 0 ; cnt < max ; cnt++)
+	{
+		sum += ((struct bench_val *) get_key(cube, keys[cnt * 1000003LL % max]))->sum;
+	}
+	end = utime();
+
+	printf("Time to get %d elements: %f seconds. (%d byte values) (sum %lld)\n", max, (end - start) / 1000000.0, BSC_VAL_SIZE, sum);
+
+	destroy_cube(cube);
+
+	free(keys);
+	free(vals);
+	free(strs);
+}
+
+#if BSC_MT
+
+// Mixed lookups, inserts and deletes on a shared cube, either through the _mt calls or through the plain calls
+// under one rwlock, which is what a caller without BSC_MT would write.
+
+struct mt_job
+{
+	struct cube *cube;
+	pthread_rwlock_t *lock;
+	unsigned int seed;
+	int ops;
+	int range;
+	long long hits;
+};
+
+void *mt_job(void *arg)
+{
+	struct mt_job *job = (struct mt_job *) arg;
+	unsigned int rnd = job->seed;
+	bsc_key key;
+	int cnt;
+
+	for (cnt = 0 ; cnt < job->ops ; cnt++)
+	{
+		rnd ^= rnd << 13;
+		rnd ^= rnd >> 17;
+		rnd ^= rnd << 5;
+
+		key = bench_key(rnd % job->range, NULL, 0);
+
+		// one in ten operations writes, inserts and deletes alternate so the volume holds steady
+
+		if (rnd / job->range % 10 == 0)
+		{
+			if (job->lock)
+			{
+				pthread_rwlock_wrlock(job->lock);
+
+				if (cnt & 1)
+				{
+					del_key(job->cube, key);
+				}
+				else
+				{
+					set_key(job->cube, key, "mt");
+				}
+				pthread_rwlock_unlock(job->lock);
+			}
+			else
+			{
+				if (cnt & 1)
+				{
+					del_key_mt(job->cube, key);
+				}
+				else
+				{
+					set_key_mt(job->cube, key, "mt");
+				}
+			}
+		}
+		else
+		{
+			if (job->lock)
+			{
+				pthread_rwlock_rdlock(job->lock);
+
+				job->hits += get_key(job->cube, key) != NULL;
+
+				pthread_rwlock_unlock(job->lock);
+			}
+			else
+			{
+				job->hits += get_key_mt(job->cube, key) != NULL;
+			}
+		}
+	}
+	return NULL;
+}
+
+void bench_mt(int max)
+{
+	static char *modes[] = { "seqlock readers", "global rwlock" };
+	struct mt_job jobs[32];
+	pthread_t threads[32];
+	pthread_rwlock_t lock;
+	struct cube *cube;
+	long long start, end, hits;
+	int mode, size, cnt;
+
+	pthread_rwlock_init(&lock, NULL);
+
+	for (mode = 0 ; mode < 2 ; mode++)
+	{
+		for (size = 1 ; size <= 32 ; size *= 2)
+		{
+			cube = create_cube();
+
+			for (cnt = 0 ; cnt < max ; cnt += 2)
+			{
+				set_key(cube, bench_key(cnt, NULL, 0), "mt");
+			}
+
+			for (cnt = 0 ; cnt < size ; cnt++)
+			{
+				jobs[cnt].cube = cube;
+				jobs[cnt].lock = mode ? &lock : NULL;
+				jobs[cnt].seed = 2463534242U + cnt * 7919;
+				jobs[cnt].ops = max / size;
+				jobs[cnt].range = max;
+				jobs[cnt].hits = 0;
+			}
+
+			start = utime();
+
+			for (cnt = 0 ; cnt < size ; cnt++)
+			{
+				pthread_create(&threads[cnt], NULL, mt_job, &jobs[cnt]);
+			}
+
+			for (cnt = hits = 0 ; cnt < size ; cnt++)
+			{
+				pthread_join(threads[cnt], NULL);
+
+				hits += jobs[cnt].hits;
+			}
+			end = utime();
+
+			printf("Time to run %d mixed operations on %2d threads: %f seconds. (%s) (hits %lld)\n", max, size, (end - start) / 1000000.0, modes[mode], hits);
+
+			check_integrity(cube, "mt");
+
+			destroy_cube(cube);
+		}
+	}
+	pthread_rwlock_destroy(&lock);
+}
+#endif
+
+#if !BSC_VAL_SIZE
+
+// The benchmark suite runs when the first argument is an option. Every combination of implementation, workload
+// and size prints a CSV row with the throughput and the p50, p99 and p999 latency in nanoseconds. Every sample-th
+// operation is timed on its own and the keys of all operations are drawn before the clock starts.
+
+// The B+tree baseline keeps up to BT_MAX keys per node and chains the leaves for range scans. Deletes do not
+// rebalance, an empty leaf stays in the chain.
+
+#define BT_MAX 64
+
+struct bt_node
+{
+	int leaf;
+	int size;
+	bsc_key keys[BT_MAX];
+	void *ptrs[BT_MAX + 1];
+	struct bt_node *next;
+};
+
+struct btree
+{
+	struct bt_node *root;
+};
+
+struct bt_node *create_bt_node(int leaf)
+{
+	struct bt_node *node = (struct bt_node *) malloc(sizeof(struct bt_node));
+
+	node->leaf = leaf;
+	node->size = 0;
+	node->next = NULL;
+
+	return node;
+}
+
+void free_bt_node(struct bt_node *node)
+{
+	int cnt;
+
+	if (!node->leaf)
+	{
+		for (cnt = 0 ; cnt <= node->size ; cnt++)
+		{
+			free_bt_node((struct bt_node *) node->ptrs[cnt]);
+		}
+	}
+	free(node);
+}
+
+// A leaf returns the first key not below key, an internal node the child that holds key.
+
+int search_bt_node(struct bt_node *node, bsc_key key)
+{
+	int bot = 0, top = node->size, mid;
+
+	while (bot < top)
+	{
+		mid = (bot + top) / 2;
+
+		if (node->leaf ? BSC_LT(node->keys[mid], key) : !BSC_LT(key, node->keys[mid]))
+		{
+			bot = mid + 1;
+		}
+		else
+		{
+			top = mid;
+		}
+	}
+	return bot;
+}
+
+// Returns the new right sibling when the node was split and sets *floor to the key that separates them.
+
+struct bt_node *insert_bt_node(struct bt_node *node, bsc_key key, void *val, bsc_key *floor)
+{
+	struct bt_node *right;
+	int pos = search_bt_node(node, key), half;
+
+	if (node->leaf)
+	{
+		if (pos < node->size && BSC_EQ(node->keys[pos], key))
+		{
+			node->ptrs[pos] = val;
+
+			return NULL;
+		}
+		memmove(&node->keys[pos + 1], &node->keys[pos], (node->size - pos) * sizeof(bsc_key));
+		memmove(&node->ptrs[pos + 1], &node->ptrs[pos], (node->size - pos) * sizeof(void *));
+
+		node->keys[pos] = key;
+		node->ptrs[pos] = val;
+	}
+	else
+	{
+		right = insert_bt_node((struct bt_node *) node->ptrs[pos], key, val, floor);
+
+		if (right == NULL)
+		{
+			return NULL;
+		}
+		memmove(&node->keys[pos + 1], &node->keys[pos], (node->size - pos) * sizeof(bsc_key));
+		memmove(&node->ptrs[pos + 2], &node->ptrs[pos + 1], (node->size - pos) * sizeof(void *));
+
+		node->keys[pos] = *floor;
+		node->ptrs[pos + 1] = right;
+	}
+
+	if (++node->size < BT_MAX)
+	{
+		return NULL;
+	}
+	right = create_bt_node(node->leaf);
+
+	half = node->size / 2;
+
+	if (node->leaf)
+	{
+		right->size = node->size - half;
+
+		memcpy(right->keys, &node->keys[half], right->size * sizeof(bsc_key));
+		memcpy(right->ptrs, &node->ptrs[half], right->size * sizeof(void *));
+
+		right->next = node->next;
+		node->next = right;
+
+		*floor = right->keys[0];
+	}
+	else
+	{
+		// the middle key moves up
+
+		right->size = node->size - half - 1;
+
+		memcpy(right->keys, &node->keys[half + 1], right->size * sizeof(bsc_key));
+		memcpy(right->ptrs, &node->ptrs[half + 1], (right->size + 1) * sizeof(void *));
+
+		*floor = node->keys[half];
+	}
+	node->size = half;
+
+	return right;
+}
+
+struct bt_node *find_bt_leaf(struct btree *tree, bsc_key key)
+{
+	struct bt_node *node = tree->root;
+
+	while (!node->leaf)
+	{
+		node = (struct bt_node *) node->ptrs[search_bt_node(node, key)];
+	}
+	return node;
+}
+
+void *create_btree(void)
+{
+	struct btree *tree = (struct btree *) malloc(sizeof(struct btree));
+
+	tree->root = create_bt_node(1);
+
+	return tree;
+}
+
+void destroy_btree(void *tree)
+{
+	free_bt_node(((struct btree *) tree)->root);
+
+	free(tree);
+}
+
+void set_btree(void *tree, bsc_key key, void *val)
+{
+	struct btree *bt = (struct btree *) tree;
+	struct bt_node *right, *root;
+	bsc_key floor;
+
+	right = insert_bt_node(bt->root, key, val, &floor);
+
+	if (right)
+	{
+		root = create_bt_node(0);
+
+		root->keys[0] = floor;
+		root->ptrs[0] = bt->root;
+		root->ptrs[1] = right;
+		root->size = 1;
+
+		bt->root = root;
+	}
+}
+
+void *get_btree(void *tree, bsc_key key)
+{
+	struct bt_node *leaf = find_bt_leaf((struct btree *) tree, key);
+	int pos = search_bt_node(leaf, key);
+
+	return pos < leaf->size && BSC_EQ(leaf->keys[pos], key) ? leaf->ptrs[pos] : NULL;
+}
+
+void *del_btree(void *tree, bsc_key key)
+{
+	struct bt_node *leaf = find_bt_leaf((struct btree *) tree, key);
+	int pos = search_bt_node(leaf, key);
+	void *val;
+
+	if (pos == leaf->size || !BSC_EQ(leaf->keys[pos], key))
+	{
+		return NULL;
+	}
+	val = leaf->ptrs[pos];
+
+	leaf->size--;
+
+	memmove(&leaf->keys[pos], &leaf->keys[pos + 1], (leaf->size - pos) * sizeof(bsc_key));
+	memmove(&leaf->ptrs[pos], &leaf->ptrs[pos + 1], (leaf->size - pos) * sizeof(void *));
+
+	return val;
+}
+
+int scan_btree(void *tree, bsc_key key, int cnt)
+{
+	struct bt_node *leaf = find_bt_leaf((struct btree *) tree, key);
+	int pos = search_bt_node(leaf, key), total = 0;
+
+	while (leaf && total < cnt)
+	{
+		if (pos < leaf->size)
+		{
+			total += leaf->ptrs[pos++] != NULL;
+		}
+		else
+		{
+			leaf = leaf->next;
+			pos = 0;
+		}
+	}
+	return total;
+}
+
+// The tsearch baseline allocates a key_pair per key like std::map, it has no range scans or index lookups.
+
+struct bench_tree
+{
+	void *root;
+};
+
+void *create_bench_tree(void)
+{
+	return calloc(1, sizeof(struct bench_tree));
+}
+
+void destroy_bench_tree(void *tree)
+{
+	struct bench_tree *rb = (struct bench_tree *) tree;
+	struct key_pair *pair;
+
+	while (rb->root)
+	{
+		pair = *(struct key_pair **) rb->root;
+
+		tdelete(pair, &rb->root, compare_key);
+
+		free(pair);
+	}
+	free(tree);
+}
+
+void set_bench_tree(void *tree, bsc_key key, void *val)
+{
+	struct key_pair *pair = (struct key_pair *) malloc(sizeof(struct key_pair)), **node;
+
+	pair->key = key;
+	pair->val = val;
+
+	node = (struct key_pair **) tsearch(pair, &((struct bench_tree *) tree)->root, compare_key);
+
+	if (*node != pair)
+	{
+		(*node)->val = val;
+
+		free(pair);
+	}
+}
+
+void *get_bench_tree(void *tree, bsc_key key)
+{
+	struct key_pair pair, **node;
+
+	pair.key = key;
+
+	node = (struct key_pair **) tfind(&pair, &((struct bench_tree *) tree)->root, compare_key);
+
+	return node ? (*node)->val : NULL;
+}
+
+void *del_bench_tree(void *tree, bsc_key key)
+{
+	struct key_pair pair, **node, *found;
+	void *val;
+
+	pair.key = key;
+
+	node = (struct key_pair **) tfind(&pair, &((struct bench_tree *) tree)->root, compare_key);
+
+	if (node == NULL)
+	{
+		return NULL;
+	}
+	found = *node;
+	val = found->val;
+
+	tdelete(found, &((struct bench_tree *) tree)->root, compare_key);
+
+	free(found);
+
+	return val;
+}
+
+void *create_bench_cube(void)
+{
+	return create_cube();
+}
+
+void destroy_bench_cube(void *tree)
+{
+	destroy_cube((struct cube *) tree);
+}
+
+void set_bench_cube(void *tree, bsc_key key, void *val)
+{
+	set_key((struct cube *) tree, key, val);
+}
+
+void *get_bench_cube(void *tree, bsc_key key)
+{
+	return get_key((struct cube *) tree, key);
+}
+
+void *del_bench_cube(void *tree, bsc_key key)
+{
+	return del_key((struct cube *) tree, key);
+}
+
+int scan_bench_cube(void *tree, bsc_key key, int cnt)
+{
+	struct cursor cursor;
+	int found, total = 0;
+
+	for (found = seek_cursor((struct cube *) tree, &cursor, key) ; found && total < cnt ; found = next_cursor(&cursor))
+	{
+		total += cursor_val(&cursor) != NULL;
+	}
+	return total;
+}
+
+void *index_bench_cube(void *tree, bsc_vol index)
+{
+	return get_index((struct cube *) tree, index);
+}
+
+struct bench_impl
+{
+	char *name;
+	void *(*create) (void);
+	void (*destroy) (void *tree);
+	void (*set) (void *tree, bsc_key key, void *val);
+	void *(*get) (void *tree, bsc_key key);
+	void *(*del) (void *tree, bsc_key key);
+	int (*scan) (void *tree, bsc_key key, int cnt);
+	void *(*index) (void *tree, bsc_vol index);
+};
+
+struct bench_impl bench_impls[] =
+{
+	{ "cube", create_bench_cube, destroy_bench_cube, set_bench_cube, get_bench_cube, del_bench_cube, scan_bench_cube, index_bench_cube },
+	{ "tsearch", create_bench_tree, destroy_bench_tree, set_bench_tree, get_bench_tree, del_bench_tree, NULL, NULL },
+	{ "btree", create_btree, destroy_btree, set_btree, get_btree, del_btree, scan_btree, NULL }
+};
+
+#define BENCH_IMPLS (int) (sizeof(bench_impls) / sizeof(struct bench_impl))
+
+enum { SUITE_INSERT, SUITE_SEQ, SUITE_UNIFORM, SUITE_ZIPF, SUITE_MIXED, SUITE_RANGE, SUITE_INDEX, SUITE_DELETE, SUITE_END };
+
+char *suite_names[] = { "insert", "seq", "uniform", "zipf", "mixed", "range", "index", "delete" };
+
+char *key_names[] = { "int", "long", "double", "str" };
+
+struct suite
+{
+	long long sizes[32];
+	int size_cnt;
+	int impls;
+	int workloads;
+	long long ops;
+	int read;
+	int length;
+	int sample;
+	int perf;
+	double theta;
+	unsigned long long seed;
+};
+
+unsigned long long bench_rand(unsigned long long *state)
+{
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+
+	return *state * 2685821657736338717ULL;
+}
+
+// base ** exp for a positive base without libm, the logarithm and exponent series are exact to about 1e-15.
+
+double bench_pow(double base, double exp)
+{
+	union { double d; unsigned long long u; } bits;
+	double t, t2, term, sum, z, f;
+	int e, k, cnt;
+
+	bits.d = base;
+
+	e = (int) ((bits.u >> 52) & 0x7ff) - 1023;
+
+	bits.u = (bits.u & 0xfffffffffffffULL) | 0x3ff0000000000000ULL;
+
+	t = (bits.d - 1) / (bits.d + 1);
+	t2 = t * t;
+
+	for (sum = 0, term = t, cnt = 1 ; cnt < 40 ; cnt += 2)
+	{
+		sum += term / cnt;
+		term *= t2;
+	}
+	z = exp * (e + 2 * sum / 0.69314718055994530942);
+
+	k = (int) z - (z < (int) z);
+
+	if (k < -1022)
+	{
+		return 0;
+	}
+	f = (z - k) * 0.69314718055994530942;
+
+	for (sum = term = 1, cnt = 1 ; cnt < 24 ; cnt++)
+	{
+		term *= f / cnt;
+		sum += term;
+	}
+	bits.u = (unsigned long long) (k + 1023) << 52;
+
+	return sum * bits.d;
+}
+
+// Zipfian ranks as generated by YCSB, rank 0 is the most popular. The zeta sum past the first million ranks is
+// replaced by its integral.
+
+struct zipf
+{
+	long long size;
+	double theta;
+	double alpha;
+	double zetan;
+	double eta;
+	double half;
+};
+
+void init_zipf(struct zipf *zipf, long long size, double theta)
+{
+	long long cnt, exact = size < 1000000 ? size : 1000000;
+
+	zipf->size = size;
+	zipf->theta = theta;
+	zipf->alpha = 1 / (1 - theta);
+	zipf->half = bench_pow(0.5, theta);
+
+	for (cnt = 1, zipf->zetan = 0 ; cnt <= exact ; cnt++)
+	{
+		zipf->zetan += bench_pow(cnt, -theta);
+	}
+
+	if (size > exact)
+	{
+		zipf->zetan += (bench_pow(size, 1 - theta) - bench_pow(exact, 1 - theta)) / (1 - theta);
+	}
+	zipf->eta = (1 - bench_pow(2.0 / size, 1 - theta)) / (1 - (1 + zipf->half) / zipf->zetan);
+}
+
+long long next_zipf(struct zipf *zipf, unsigned long long *state)
+{
+	double u = (bench_rand(state) >> 11) * (1.0 / 9007199254740992.0);
+	double uz = u * zipf->zetan;
+	long long rank;
+
+	if (uz < 1)
+	{
+		return 0;
+	}
+
+	if (uz < 1 + zipf->half || zipf->size < 3)
+	{
+		return 1 % zipf->size;
+	}
+	rank = (long long) (zipf->size * bench_pow(zipf->eta * u - zipf->eta + 1, zipf->alpha));
+
+	return rank < zipf->size ? rank : zipf->size - 1;
+}
+
+// Hardware counters from perf_event_open, each counter is opened on its own so one the CPU or kernel does not
+// offer reads as -1 without disabling the others. Counts are scaled when the kernel multiplexed them.
+
+#define BENCH_COUNTERS 6
+
+char *counter_names[BENCH_COUNTERS] = { "cycles", "instructions", "l1d_misses", "llc_misses", "branch_misses", "dtlb_misses" };
+
+struct counters
+{
+	int fds[BENCH_COUNTERS];
+	double vals[BENCH_COUNTERS];
+};
+
+void open_counters(struct counters *counters)
+{
+	int cnt;
+#ifdef __linux__
+	static unsigned int types[BENCH_COUNTERS] = { PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE };
+	static unsigned long long configs[BENCH_COUNTERS] =
+	{
+		PERF_COUNT_HW_CPU_CYCLES,
+		PERF_COUNT_HW_INSTRUCTIONS,
+		PERF_COUNT_HW_CACHE_L1D | PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16,
+		PERF_COUNT_HW_CACHE_LL | PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16,
+		PERF_COUNT_HW_BRANCH_MISSES,
+		PERF_COUNT_HW_CACHE_DTLB | PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16
+	};
+	struct perf_event_attr attr;
+
+	for (cnt = 0 ; cnt < BENCH_COUNTERS ; cnt++)
+	{
+		memset(&attr, 0, sizeof(struct perf_event_attr));
+
+		attr.size = sizeof(struct perf_event_attr);
+		attr.type = types[cnt];
+		attr.config = configs[cnt];
+		attr.disabled = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+		counters->fds[cnt] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+	}
+#else
+	for (cnt = 0 ; cnt < BENCH_COUNTERS ; cnt++)
+	{
+		counters->fds[cnt] = -1;
+	}
+#endif
+}
+
+void start_counters(struct counters *counters)
+{
+#ifdef __linux__
+	int cnt;
+
+	for (cnt = 0 ; cnt < BENCH_COUNTERS ; cnt++)
+	{
+		if (counters->fds[cnt] != -1)
+		{
+			ioctl(counters->fds[cnt], PERF_EVENT_IOC_RESET, 0);
+			ioctl(counters->fds[cnt], PERF_EVENT_IOC_ENABLE, 0);
+		}
+	}
+#endif
+}
+
+// Stops the counters and leaves each count in vals, -1 for a counter that could not be opened or never ran.
+
+void stop_counters(struct counters *counters)
+{
+	int cnt;
+#ifdef __linux__
+	unsigned long long data[3];
 
-	cube->x_size[w + 1] = cube->x_size[w] / 2;
-	cube->x_size[w] -= cube->x_size[w + 1];
+	for (cnt = 0 ; cnt < BENCH_COUNTERS ; cnt++)
+	{
+		counters->vals[cnt] = -1;
 
-	memcpy(&w_node2->x_floor[0], &w_node1->x_floor[cube->x_size[w]], cube->x_size[w + 1] * sizeof(int));
-	memcpy(&w_node2->x_axis[0], &w_node1->x_axis[cube->x_size[w]], cube->x_size[w + 1] * sizeof(struct x_node *));
-	memcpy(&w_node2->x_volume[0], &w_node1->x_volume[cube->x_size[w]], cube->x_size[w + 1] * sizeof(unsigned short));
-	memcpy(&w_node2->y_size[0], &w_node1->y_size[cube->x_size[w]], cube->x_size[w + 1] * sizeof(unsigned short));
+		if (counters->fds[cnt] != -1)
+		{
+			ioctl(counters->fds[cnt], PERF_EVENT_IOC_DISABLE, 0);
 
-	for (x = volume = 0 ; x < cube->x_size[w] ; x++)
+			if (read(counters->fds[cnt], data, sizeof(data)) == sizeof(data) && data[2])
+			{
+				counters->vals[cnt] = (double) data[0] * data[1] / data[2];
+			}
+		}
+	}
+#else
+	for (cnt = 0 ; cnt < BENCH_COUNTERS ; cnt++)
 	{
-		volume += w_node1->x_volume[x];
+		counters->vals[cnt] = -1;
 	}
+#endif
+}
 
-	cube->w_volume[w + 1] = cube->w_volume[w] - volume;
-	cube->w_volume[w] = volume;
+void close_counters(struct counters *counters)
+{
+	int cnt;
 
-	cube->w_floor[w + 1] = w_node2->x_floor[0];
+	for (cnt = 0 ; cnt < BENCH_COUNTERS ; cnt++)
+	{
+		if (counters->fds[cnt] != -1)
+		{
+			close(counters->fds[cnt]);
+		}
+	}
 }
 
-void merge_w_node(struct cube *cube, unsigned short w1, unsigned short w2)
+int compare_latency(const void *a, const void *b)
 {
-	struct w_node *w_node1 = cube->w_axis[w1];
-	struct w_node *w_node2 = cube->w_axis[w2];
+	return *(long long *) a < *(long long *) b ? -1 : *(long long *) a > *(long long *) b;
+}
 
-	w_node1->x_floor = (int *) realloc(w_node1->x_floor, cube->m_size * sizeof(int));
-	w_node1->x_axis = (struct x_node **) realloc(w_node1->x_axis, cube->m_size * sizeof(struct x_node *));
-	w_node1->x_volume = (unsigned short *) realloc(w_node1->x_volume, cube->m_size * sizeof(unsigned short));
-	w_node1->y_size = (unsigned short *) realloc(w_node1->y_size, cube->m_size * sizeof(unsigned short));
+// Keys are the even numbers below size * 2 in random order, mixed writes also draw odd keys. With BSC_KEY_STR the
+// sequential workload inserts in numeric rather than string order.
 
-	memcpy(&w_node1->x_floor[cube->x_size[w1]], &w_node2->x_floor[0], cube->x_size[w2] * sizeof(int));
-	memcpy(&w_node1->x_axis[cube->x_size[w1]], &w_node2->x_axis[0], cube->x_size[w2] * sizeof(struct x_node *));
-	memcpy(&w_node1->x_volume[cube->x_size[w1]], &w_node2->x_volume[0], cube->x_size[w2] * sizeof(unsigned short));
-	memcpy(&w_node1->y_size[cube->x_size[w1]], &w_node2->y_size[0], cube->x_size[w2] * sizeof(unsigned short));
+void run_suite(struct suite *suite, struct bench_impl *impl, int workload, long long size)
+{
+	unsigned long long state = suite->seed;
+	long long cnt, ops, swap, start, begin, end, *lat, lat_cnt, hits = 0;
+	bsc_key *keys, *op_keys = NULL, key;
+	char *strs, *op_strs = NULL;
+	int *op_ints = NULL, *perm, tmp;
+	void *tree;
+	struct zipf zipf;
+	struct counters counters;
+
+	if ((workload == SUITE_RANGE && impl->scan == NULL) || (workload == SUITE_INDEX && impl->index == NULL))
+	{
+		return;
+	}
 
-	cube->x_size[w1] += cube->x_size[w2];
+	switch (workload)
+	{
+		case SUITE_INSERT:
+		case SUITE_SEQ:
+		case SUITE_DELETE:
+			ops = size;
+			break;
+		case SUITE_RANGE:
+			ops = suite->ops ? suite->ops : size / suite->length + 1;
+			break;
+		default:
+			ops = suite->ops ? suite->ops : size;
+			break;
+	}
 
-	cube->w_volume[w1] += cube->w_volume[w2];
+	perm = (int *) malloc(size * sizeof(int));
+	keys = (bsc_key *) malloc(size * sizeof(bsc_key));
+	strs = (char *) malloc(BSC_KEY == BSC_KEY_STR ? size * 32 : 1);
 
-	remove_w_node(cube, w2);
-}
+	for (cnt = 0 ; cnt < size ; cnt++)
+	{
+		perm[cnt] = cnt;
+	}
 
-void split_x_node(struct cube *cube, unsigned short w, unsigned short x)
-{
-	struct w_node *w_node;
-	struct x_node *x_node1, *x_node2;
-	unsigned short y;
-	int volume;
+	if (workload != SUITE_SEQ)
+	{
+		for (cnt = size - 1 ; cnt > 0 ; cnt--)
+		{
+			swap = bench_rand(&state) % (cnt + 1);
 
-	insert_x_node(cube, w, x + 1);
+			tmp = perm[cnt];
+			perm[cnt] = perm[swap];
+			perm[swap] = tmp;
+		}
+	}
 
-	w_node = cube->w_axis[w];
+	for (cnt = 0 ; cnt < size ; cnt++)
+	{
+		keys[cnt] = bench_key(perm[cnt] * 2, &strs[BSC_KEY == BSC_KEY_STR ? cnt * 32 : 0], 0);
+	}
 
-	x_node1 = w_node->x_axis[x];
-	x_node2 = w_node->x_axis[x + 1];
+	if (workload != SUITE_INSERT && workload != SUITE_SEQ)
+	{
+		op_keys = (bsc_key *) malloc(ops * sizeof(bsc_key));
+	}
 
-	w_node->y_size[x + 1] = w_node->y_size[x] / 2;
-	w_node->y_size[x] -= w_node->y_size[x + 1];
+	if (workload == SUITE_MIXED || workload == SUITE_INDEX)
+	{
+		op_ints = (int *) malloc(ops * sizeof(int));
+	}
 
-	memcpy(&x_node2->y_floor[0], &x_node1->y_floor[w_node->y_size[x]], w_node->y_size[x + 1] * sizeof(int));
-	memcpy(&x_node2->y_axis[0], &x_node1->y_axis[w_node->y_size[x]], w_node->y_size[x + 1] * sizeof(struct y_node *));
-	memcpy(&x_node2->z_size[0], &x_node1->z_size[w_node->y_size[x]], w_node->y_size[x + 1] * sizeof(unsigned char));
+	if (workload == SUITE_ZIPF)
+	{
+		init_zipf(&zipf, size, suite->theta);
+	}
 
-	for (y = volume = 0 ; y < w_node->y_size[x] ; y++)
+	if (workload == SUITE_MIXED)
 	{
-		volume += x_node1->z_size[y];
+		op_strs = (char *) malloc(BSC_KEY == BSC_KEY_STR ? ops * 32 : 1);
 	}
 
-	w_node->x_volume[x + 1] = w_node->x_volume[x] - volume;
-	w_node->x_volume[x] = volume;
+	for (cnt = 0 ; cnt < ops && op_keys ; cnt++)
+	{
+		switch (workload)
+		{
+			case SUITE_ZIPF:
+				op_keys[cnt] = keys[next_zipf(&zipf, &state)];
+				break;
+			case SUITE_MIXED:
+				op_ints[cnt] = (int) (bench_rand(&state) % 100) >= suite->read;
 
-	cube->w_axis[w]->x_floor[x + 1] = x_node2->y_floor[0];
-}
+				if (op_ints[cnt])
+				{
+					op_keys[cnt] = bench_key(bench_rand(&state) % (size * 2), &op_strs[BSC_KEY == BSC_KEY_STR ? cnt * 32 : 0], 0);
+				}
+				else
+				{
+					op_keys[cnt] = keys[bench_rand(&state) % size];
+				}
+				break;
+			case SUITE_INDEX:
+				op_ints[cnt] = bench_rand(&state) % size;
+				break;
+			case SUITE_DELETE:
+				op_keys[cnt] = keys[cnt];
+				break;
+			default:
+				op_keys[cnt] = keys[bench_rand(&state) % size];
+				break;
+		}
+	}
 
-void merge_x_node(struct cube *cube, unsigned short w, unsigned short x1, unsigned short x2)
-{
-	struct w_node *w_node = cube->w_axis[w];
-	struct x_node *x_node1 = w_node->x_axis[x1];
-	struct x_node *x_node2 = w_node->x_axis[x2];
+	if (workload == SUITE_DELETE)
+	{
+		for (cnt = size - 1 ; cnt > 0 ; cnt--)
+		{
+			swap = bench_rand(&state) % (cnt + 1);
 
-	x_node1->y_floor = (int *) realloc(x_node1->y_floor, cube->m_size * sizeof(int));
-	x_node1->y_axis = (struct y_node **) realloc(x_node1->y_axis, cube->m_size * sizeof(struct y_node *));
-	x_node1->z_size = (unsigned char *) realloc(x_node1->z_size, cube->m_size * sizeof(unsigned char));
+			key = op_keys[cnt];
+			op_keys[cnt] = op_keys[swap];
+			op_keys[swap] = key;
+		}
+	}
 
-	memcpy(&x_node1->y_floor[w_node->y_size[x1]], &x_node2->y_floor[0], w_node->y_size[x2] * sizeof(int));
-	memcpy(&x_node1->y_axis[w_node->y_size[x1]], &x_node2->y_axis[0], w_node->y_size[x2] * sizeof(struct y_node *));
-	memcpy(&x_node1->z_size[w_node->y_size[x1]], &x_node2->z_size[0], w_node->y_size[x2] * sizeof(unsigned char));
+	tree = impl->create();
 
-	w_node->y_size[x1] += w_node->y_size[x2];
+	if (workload != SUITE_INSERT && workload != SUITE_SEQ)
+	{
+		for (cnt = 0 ; cnt < size ; cnt++)
+		{
+			impl->set(tree, keys[cnt], keys);
+		}
+	}
+	else
+	{
+		op_keys = keys;
+	}
 
-	w_node->x_volume[x1] += w_node->x_volume[x2];
+	lat = (long long *) malloc((ops / suite->sample + 1) * sizeof(long long));
+	lat_cnt = 0;
 
-	remove_x_node(cube, w, x2);
-}
+	if (suite->perf)
+	{
+		open_counters(&counters);
+		start_counters(&counters);
+	}
+	start = ntime();
 
+	for (cnt = 0 ; cnt < ops ; cnt++)
+	{
+		begin = cnt % suite->sample ? 0 : ntime();
 
-void split_y_node(struct cube *cube, unsigned short w, unsigned short x, unsigned short y)
-{
-	struct x_node *x_node;
-	struct y_node *y_node1, *y_node2;
+		switch (workload)
+		{
+			case SUITE_INSERT:
+			case SUITE_SEQ:
+				impl->set(tree, op_keys[cnt], keys);
+				break;
+			case SUITE_UNIFORM:
+			case SUITE_ZIPF:
+				hits += impl->get(tree, op_keys[cnt]) != NULL;
+				break;
+			case SUITE_MIXED:
+				if (op_ints[cnt])
+				{
+					impl->set(tree, op_keys[cnt], keys);
+				}
+				else
+				{
+					hits += impl->get(tree, op_keys[cnt]) != NULL;
+				}
+				break;
+			case SUITE_RANGE:
+				hits += impl->scan(tree, op_keys[cnt], suite->length);
+				break;
+			case SUITE_INDEX:
+				hits += impl->index(tree, op_ints[cnt]) != NULL;
+				break;
+			case SUITE_DELETE:
+				hits += impl->del(tree, op_keys[cnt]) != NULL;
+				break;
+		}
 
-	insert_y_node(cube, w, x, y + 1);
+		if (begin)
+		{
+			lat[lat_cnt++] = ntime() - begin;
+		}
+	}
+	end = ntime();
 
-	x_node = cube->w_axis[w]->x_axis[x];
+	if (suite->perf)
+	{
+		stop_counters(&counters);
+		close_counters(&counters);
+	}
+	qsort(lat, lat_cnt, sizeof(long long), compare_latency);
 
-	y_node1 = x_node->y_axis[y];
-	y_node2 = x_node->y_axis[y + 1];
+	printf("%s,%s,%s,%lld,%lld,%f,%f,%lld,%lld,%lld,%lld", impl->name, suite_names[workload], key_names[BSC_KEY], size, ops, (end - start) / 1000000000.0, ops * 1000.0 / (end - start), lat[lat_cnt * 500 / 1000], lat[lat_cnt * 990 / 1000], lat[lat_cnt * 999 / 1000], hits);
 
-	x_node->z_size[y + 1] = x_node->z_size[y] / 2;
-	x_node->z_size[y] -= x_node->z_size[y + 1];
+	// counts per operation, -1 when the counter is not available
 
-	memcpy(&y_node2->z_keys[0], &y_node1->z_keys[x_node->z_size[y]], x_node->z_size[y + 1] * sizeof(int));
-	memcpy(&y_node2->z_vals[0], &y_node1->z_vals[x_node->z_size[y]], x_node->z_size[y + 1] * sizeof(void *));
+	for (cnt = 0 ; suite->perf && cnt < BENCH_COUNTERS ; cnt++)
+	{
+		printf(",%f", counters.vals[cnt] < 0 ? -1 : counters.vals[cnt] / ops);
+	}
+	printf("\n");
 
-	x_node->y_floor[y + 1] = y_node2->z_keys[0];
-}
+	fflush(stdout);
 
-void merge_y_node(struct cube *cube, unsigned short w, unsigned short x, unsigned short y1, unsigned short y2)
-{
-	struct x_node *x_node = cube->w_axis[w]->x_axis[x];
+	impl->destroy(tree);
 
-	struct y_node *y_node1 = x_node->y_axis[y1];
-	struct y_node *y_node2 = x_node->y_axis[y2];
+	if (op_keys != keys)
+	{
+		free(op_keys);
+	}
+	free(op_ints);
+	free(op_strs);
+	free(lat);
+	free(keys);
+	free(strs);
+	free(perm);
+}
 
-	memcpy(&y_node1->z_keys[x_node->z_size[y1]], &y_node2->z_keys[0], x_node->z_size[y2] * sizeof(int));
-	memcpy(&y_node1->z_vals[x_node->z_size[y1]], &y_node2->z_vals[0], x_node->z_size[y2] * sizeof(void *));
+// Sizes take a k, m or g suffix, a size of 0 is returned for anything that is not a size.
 
-	x_node->z_size[y1] += x_node->z_size[y2];
+long long parse_size(char *arg)
+{
+	char *end;
+	long long size = strtoll(arg, &end, 10);
 
-	remove_y_node(cube, w, x, y2);
+	switch (*end)
+	{
+		case 'k':
+		case 'K':
+			size *= 1000;
+			end++;
+			break;
+		case 'm':
+		case 'M':
+			size *= 1000000;
+			end++;
+			break;
+		case 'g':
+		case 'G':
+			size *= 1000000000;
+			end++;
+			break;
+	}
+	return *end || size < 0 ? 0 : size;
 }
 
-void show_cube(struct cube *cube, unsigned short depth)
+// Sets the bit of every name in a comma separated list, returns 0 for an unknown name.
+
+int parse_names(char *arg, char **names, int cnt)
 {
-	struct w_node *w_node;
-	struct x_node *x_node;
-	struct y_node *y_node;
-	unsigned short w, x, y, z;
+	char *name;
+	int mask = 0, bit;
 
-	for (w = 0 ; w < cube->w_size ; w++)
+	for (name = strtok(arg, ",") ; name ; name = strtok(NULL, ","))
 	{
-		w_node = cube->w_axis[w];
+		for (bit = 0 ; bit < cnt && strcmp(name, names[bit]) ; bit++);
 
-		if (depth == 1)
+		if (bit == cnt)
 		{
-			printf("w index [%3d] x size [%3d] volume [%10d]\n", w, cube->x_size[w], cube->w_volume[w]);
-
-			continue;
+			return 0;
 		}
+		mask |= 1 << bit;
+	}
+	return mask;
+}
 
-		for (x = 0 ; x < cube->x_size[w] ; x++)
-		{
-			x_node = w_node->x_axis[x];
-
-			if (depth == 2)
-			{
-				printf("w [%3d] x [%3d] s [%3d] v [%10d]\n", w, x, w_node->y_size[x], w_node->x_volume[x]);
+void suite_usage(char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  -i impls      cube,tsearch,btree (all)\n"
+		"  -w workloads  insert,seq,uniform,zipf,mixed,range,index,delete (all)\n"
+		"  -n sizes      comma separated sizes from 1k to 100m (1m)\n"
+		"  -o ops        operations per run, the size for insert, seq and delete (size)\n"
+		"  -r percent    reads in the mixed workload (90)\n"
+		"  -t theta      zipf skew between 0 and 1 (0.99)\n"
+		"  -l length     keys per range scan (100)\n"
+		"  -S sample     time every sample-th operation (16)\n"
+		"  -s seed       random seed (10)\n"
+		"  -p            add per operation cycles, instructions, L1D, LLC, branch and dTLB misses\n"
+		"tsearch has no range or index workload and btree no index workload.\n", name);
+}
 
-				continue;
-			}
+int bench_suite(int argc, char **argv)
+{
+	char *impl_names[BENCH_IMPLS], *size;
+	struct suite suite;
+	int opt, cnt, workload, impl;
 
-			for (y = 0 ; y < w_node->y_size[x] ; y++)
-			{
-				y_node = x_node->y_axis[y];
+	memset(&suite, 0, sizeof(struct suite));
 
-				if (depth == 3)
-				{
-					printf("w [%3d] x [%3d] y [%3d] s [%3d]\n", w, x, y, x_node->z_size[y]);
+	suite.impls = (1 << BENCH_IMPLS) - 1;
+	suite.workloads = (1 << SUITE_END) - 1;
+	suite.read = 90;
+	suite.length = 100;
+	suite.sample = 16;
+	suite.theta = 0.99;
+	suite.seed = 10;
 
-					continue;
-				}
+	for (cnt = 0 ; cnt < BENCH_IMPLS ; cnt++)
+	{
+		impl_names[cnt] = bench_impls[cnt].name;
+	}
 
-				for (z = 0 ; z < x_node->z_size[y] ; z++)
+	while ((opt = getopt(argc, argv, "i:w:n:o:r:t:l:S:s:ph")) != -1)
+	{
+		switch (opt)
+		{
+			case 'i':
+				suite.impls = parse_names(optarg, impl_names, BENCH_IMPLS);
+				break;
+			case 'w':
+				suite.workloads = parse_names(optarg, suite_names, SUITE_END);
+				break;
+			case 'n':
+				for (size = strtok(optarg, ",") ; size && suite.size_cnt < 32 ; size = strtok(NULL, ","))
 				{
-					printf("w [%3d] x [%3d] y [%3d] z [%3d] [%010d] (%s)\n", w, x, y, z, y_node->z_keys[z], (char *) y_node->z_vals[z]);
+					suite.sizes[suite.size_cnt++] = parse_size(size);
 				}
-			}
+				break;
+			case 'o':
+				suite.ops = parse_size(optarg);
+				break;
+			case 'r':
+				suite.read = atoi(optarg);
+				break;
+			case 't':
+				suite.theta = atof(optarg);
+				break;
+			case 'l':
+				suite.length = atoi(optarg);
+				break;
+			case 'S':
+				suite.sample = atoi(optarg);
+				break;
+			case 's':
+				suite.seed = strtoull(optarg, NULL, 10) | 1;
+				break;
+			case 'p':
+				suite.perf = 1;
+				break;
+			default:
+				suite_usage(argv[0]);
+				return 1;
 		}
 	}
-}
 
-void check_integrity(struct cube *cube, char *msg)
-{
-	struct y_node *y_node;
-	unsigned short w, x, y, z;
-	int last;
+	if (suite.size_cnt == 0)
+	{
+		suite.sizes[suite.size_cnt++] = 1000000;
+	}
 
-	return;
+	for (cnt = 0 ; cnt < suite.size_cnt ; cnt++)
+	{
+		if (suite.sizes[cnt] < 1 || suite.sizes[cnt] > 500000000)
+		{
+			suite.impls = 0;
+		}
+	}
 
-	if (cube->w_size == 0)
+	if (optind < argc || suite.impls == 0 || suite.workloads == 0 || suite.read < 0 || suite.read > 100 || suite.theta <= 0 || suite.theta >= 1 || suite.length < 1 || suite.sample < 1)
 	{
-		return;
+		suite_usage(argv[0]);
+		return 1;
 	}
 
-	last = cube->w_floor[0];
+	printf("impl,workload,key,size,ops,seconds,mops,p50_ns,p99_ns,p999_ns,hits");
 
-	for (w = 0 ; w < cube->w_size ; w++)
+	for (cnt = 0 ; suite.perf && cnt < BENCH_COUNTERS ; cnt++)
 	{
-		for (x = 0 ; x < cube->x_size[w] ; x++)
+		printf(",%s_op", counter_names[cnt]);
+	}
+	printf("\n");
+
+	for (cnt = 0 ; cnt < suite.size_cnt ; cnt++)
+	{
+		for (workload = 0 ; workload < SUITE_END ; workload++)
 		{
-			for (y = 0 ; y < cube->w_axis[w]->y_size[x] ; y++)
+			for (impl = 0 ; impl < BENCH_IMPLS ; impl++)
 			{
-				for (z = 0 ; z < cube->w_axis[w]->x_axis[x]->z_size[y] ; z++)
+				if ((suite.workloads & 1 << workload) && (suite.impls & 1 << impl))
 				{
-					y_node = cube->w_axis[w]->x_axis[x]->y_axis[y];
-
-					if (last > y_node->z_keys[z])
-					{
-						printf("\e[1;31mcheck integrity: corruption %s.\e[0m\n", msg);
-						return;
-					}
-					last = y_node->z_keys[z];
+					run_suite(&suite, &bench_impls[impl], workload, suite.sizes[cnt]);
 				}
 			}
 		}
 	}
+	return 0;
 }
-
-long long utime()
-{
-	struct timeval now_time;
-
-	gettimeofday(&now_time, NULL);
-
-	return now_time.tv_sec * 1000000LL + now_time.tv_usec;
-}
+#endif
 
 int main(int argc, char **argv)
 {
 	static int max = 1000000;
-	int cnt, loop;
-	long long start, end;
-	void *val;
-	struct cube *cube;
 
-	if (argv[1] && *argv[1])
+#if !BSC_VAL_SIZE
+	if (argc > 1 && argv[1][0] == '-')
+	{
+		return bench_suite(argc, argv);
+	}
+#endif
+
+	if (argc > 1 && *argv[1])
 	{
 		printf("%s\n", argv[1]);
 	}
 
-	val = strdup("value");
+	if (argc > 2 && atoi(argv[2]) > 0)
+	{
+		max = atoi(argv[2]);
+	}
 
-	cube = create_cube();
-	start = utime();
-	srand(10);
+#if BSC_VAL_SIZE
+	bench_values(max);
+#elif BSC_KEY != BSC_KEY_INT
+	bench_keys(max, 0);
 
-	for (loop = 0 ; loop < 1 ; loop++)
+	if (BSC_KEY == BSC_KEY_STR)
 	{
-		destroy_cube(cube);
-		cube = create_cube();
-		for (cnt = 1 ; cnt <= max ; cnt++)
-		{
-			set_key(cube, 0 + rand(), val);
-		}
+		bench_keys(max, 1);
 	}
-	end = utime();
-	printf("Time to insert %d elements: %f seconds. (random order) (w_size %d)\n", max, (end - start) / 1000000.0, cube->w_size);
+#else
+	bench_orders(max);
 
-	check_integrity(cube, "rnd order");
+	bench_sorted(max);
 
-	srand(10);
+	bench_export(max);
 
-	while (cube->volume)
-	{
-		del_index(cube, cube->volume - 1);
-	}
-	end = utime();
-	printf("Time to delete %d elements: %f seconds. (random order) (w_size %d)\n", max, (end - start) / 1000000.0, cube->w_size);
+	bench_range(max);
 
-	destroy_cube(cube);
+	bench_rank(max);
 
-	cube = create_cube();
-	start = utime();
-	for (cnt = 1 ; cnt <= max ; cnt++)
-	{
-		set_key(cube, 0 + cnt, "fwd order");
-	}
-	end = utime();
-	printf("Time to insert %d elements: %f seconds. (forward order)\n", max, (end - start) / 1000000.0);
+	bench_search(max);
 
-	check_integrity(cube, "fwd order");
+	bench_batch(max);
 
-	destroy_cube(cube);
+	bench_sorted_batch(max);
 
-	cube = create_cube();
-	start = utime();
-	for (cnt = 1 ; cnt <= max ; cnt++)
-	{
-		set_key(cube, max - cnt, "rev order");
-	}
-	end = utime();
+	bench_hint(max);
 
-	check_integrity(cube, "rev order");
+	bench_queue(max);
 
-	printf("Time to insert %d elements: %f seconds. (reverse order)\n", max, (end - start) / 1000000.0);
-	destroy_cube(cube);
+	bench_cubesort(max);
+
+	bench_buffer(max);
+
+	bench_values(max);
+
+	bench_shard(max);
+
+	bench_snapshot(max);
 
+#if BSC_MVCC
+	bench_mvcc(max);
+#endif
+#if BSC_LARGE
+	bench_large(max);
+#endif
+#endif
+#if BSC_MT
+	bench_mt(max);
+#endif
 	return 0;
 }